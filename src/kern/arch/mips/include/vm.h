@@ -117,10 +117,9 @@ paddr_t ram_getfirstfree(void);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_start;		/* First page to invalidate */
+	unsigned ts_npages;		/* Number of pages */
+	volatile bool *ts_done;		/* Set [cpu number] once done */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -148,6 +148,26 @@ syscall(struct trapframe *tf)
 	        /* TODO: just avoid crash */
  	        sys__exit((int)tf->tf_a0);
                 break;
+	    case SYS_getpriority:
+		err = sys_getpriority((int)tf->tf_a0,
+				      (int)tf->tf_a1,
+				      &retval);
+		break;
+	    case SYS_setpriority:
+		err = sys_setpriority((int)tf->tf_a0,
+				      (int)tf->tf_a1,
+				      (int)tf->tf_a2);
+		break;
+	    case SYS_setaffinity:
+		err = sys_setaffinity((int)tf->tf_a0,
+				      (unsigned)tf->tf_a1);
+		break;
+#if OPT_PAGING
+	    case SYS_getrusage:
+		err = sys_getrusage((int)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+#endif
 #endif
 
 	    default:
@@ -203,6 +203,19 @@ cpu_identify(char *buf, size_t max)
 #define GET_STATUS(x) __asm volatile("mfc0 %0,$12" : "=r" (x))
 #define SET_STATUS(x) __asm volatile("mtc0 %0,$12" :: "r" (x))
 
+/*
+ * Read the cycle counter (cop0 register 9). It is per-cpu and wraps
+ * around, so only differences taken on the same cpu are meaningful.
+ */
+uint32_t
+cpu_getcycles(void)
+{
+	uint32_t count;
+
+	__asm volatile("mfc0 %0,$9" : "=r" (count));
+	return count;
+}
+
 /*
  * Interrupts on.
  */
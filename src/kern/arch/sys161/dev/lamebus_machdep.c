@@ -76,6 +76,17 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Set the c0_count register.
+ */
+static
+void
+mips_count_set(uint32_t count)
+{
+	/* $9 == c0_count */
+	__asm volatile("mtc0 %0, $9" :: "r" (count));
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -119,6 +130,55 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Stop the on-chip timer of this CPU, for idling without ticks. It
+ * cannot be switched off, so just set it as far away as it goes
+ * (about three minutes at 25 MHz).
+ */
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_set(0xffffffff);
+}
+
+/*
+ * Restart the HZ timer after mainbus_hardclock_stop.
+ *
+ * c0_count only goes back to zero when it matches c0_compare, so
+ * after an idle of more than a tick it is already past the HZ value:
+ * left alone, the next tick would only come when it wraps. So it is
+ * cleared, the ticks missed are added to c_hardclocks, and the timer
+ * is set to go off right away for the last of them. hardclock cannot
+ * be called from here, in the middle of thread_switch; it runs from
+ * the timer interrupt once interrupts are back on.
+ */
+void
+mainbus_hardclock_start(void)
+{
+	uint32_t count;
+
+	count = cpu_getcycles();
+	if (count < CPU_FREQUENCY / HZ) {
+		/* not even a tick: it comes at the usual time */
+		mips_timer_set(CPU_FREQUENCY / HZ);
+		return;
+	}
+
+	curcpu->c_hardclocks += count / (CPU_FREQUENCY / HZ) - 1;
+	mips_count_set(0);
+	mips_timer_set(1);
+}
+
+/*
+ * The on-chip timer goes off, and c0_count restarts from zero, every
+ * CPU_FREQUENCY / HZ cycles.
+ */
+uint32_t
+mainbus_cycles_per_hardclock(void)
+{
+	return CPU_FREQUENCY / HZ;
+}
+
 /*
  * Start all secondary CPUs.
  */
@@ -41,9 +41,11 @@
 
 #if OPT_PAGING
 
+#include <spinlock.h>
 #include <pt.h>
 #include <segments.h>
 #include <vnode.h>
+#include <vm_tlb.h>
 
 #define STACK_PAGES 18
 
@@ -63,8 +65,12 @@ struct addrspace {
         struct vnode *v;        // Program vnode
         pagetable *pt;          // Process page table
         size_t pt_num_pages;    // Page table's number of pages
-        struct lock *pt_lock;   // Page table lock
+        struct rwlock *pt_lock; // Page table lock: TLB reloads only read, so they run in parallel
+        struct spinlock pt_transit_lock;        // Protects pt_transit_wchan
+        struct wchan *pt_transit_wchan;         // Woken when an in-transit page becomes valid
         char *progname;         // Program name: main purpose is for as_copy
+        vaddr_t pinned[TLB_WIRED_SLOTS];        // Pages kept in the wired TLB slots
+        unsigned int num_pinned;
 #elif OPT_DUMBVM
         vaddr_t as_vbase1;
         paddr_t as_pbase1;
@@ -115,6 +121,10 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_pin_page - keep the translation of a page in a wired TLB slot
+ *                while the address space is active, so it is never
+ *                evicted from the TLB. as_unpin_page undoes it.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -149,6 +159,8 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 #if OPT_PAGING
 segment *as_find_segment(struct addrspace *as, vaddr_t vaddr);
+int               as_pin_page(struct addrspace *as, vaddr_t vaddr);
+void              as_unpin_page(struct addrspace *as, vaddr_t vaddr);
 #endif
 
 /*
@@ -16,6 +16,10 @@ struct coremap_entry {
     struct addrspace *as;
     //only for user space
     paddr_t prev_allocated, next_allocated;
+    int evicting;                       //being swapped out by getppage_user(): as and vaddr must not change
+    int loading;                        //handed out by getppage_user(), not in the page table yet
+    //only for kernel space: kmalloc pageref if the page holds subpage blocks
+    void *kref;
 };
 
 int coremap_init(void);
@@ -23,8 +27,15 @@ int coremap_close(void);
 
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
-paddr_t getppage_user(vaddr_t vaddr);
+unsigned int coremap_get_alloc_size(vaddr_t kvaddr);
+void coremap_fragstats(unsigned int *nfree, unsigned int *largest_run);
+void coremap_set_kref(vaddr_t kvaddr, void *kref);
+int coremap_get_kref(vaddr_t kvaddr, void **kref);
+paddr_t getppage_user(vaddr_t vaddr, vaddr_t *evicted);
+void coremap_user_loaded(paddr_t paddr);
 void freeppage_user(paddr_t paddr);
+unsigned int freeppages_user_as(struct addrspace *as);
+unsigned int coremap_count_user_as(struct addrspace *as);
 
 
 #endif
\ No newline at end of file
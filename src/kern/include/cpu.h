@@ -36,6 +36,13 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of priority levels of the multi-level feedback queue
+ * scheduler. Each cpu has one run queue per level; level 0 is the
+ * highest priority.
+ */
+#define SCHED_NLEVELS	4
+
 /*
  * Per-cpu structure
  *
@@ -59,15 +66,21 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_migrating;	/* Threads leaving this cpu */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * c_isidle and c_runqueue_count are also read by other cpus
+	 * without the lock, as hints for load balancing.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues, by level */
+	unsigned c_runqueue_mask;	/* One bit for each nonempty level */
+	volatile unsigned c_runqueue_count; /* Threads on all run queues */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -117,6 +130,12 @@ void cpu_hatch(unsigned software_number);
  */
 void cpu_identify(char *buf, size_t max);
 
+/*
+ * Read the current CPU's cycle counter. It wraps around, and the
+ * counters of different CPUs are not in sync.
+ */
+uint32_t cpu_getcycles(void);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
@@ -155,6 +174,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends it to all CPUs except the current
+ * one, and returns how many that was.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +190,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -33,38 +33,89 @@
 /*
  * Simple deadlock detector. Enable with "options hangman" in the
  * kernel config.
+ *
+ * The same hooks feed the lock contention profiler, enabled with
+ * "options lockprof" (see lockprof.h); either or both can be on.
  */
 
 #include "opt-hangman.h"
+#include "opt-lockprof.h"
 
-#if OPT_HANGMAN
+#if OPT_HANGMAN || OPT_LOCKPROF
+
+struct lockprof_class;
 
 struct hangman_actor {
 	const char *a_name;
 	const struct hangman_lockable *a_waiting;
+#if OPT_LOCKPROF
+	uint32_t a_waitstart;		/* Cycle count when it began waiting */
+	unsigned a_waitcpu;		/* ...on this cpu */
+	unsigned a_waitclock;		/* ...at this c_hardclocks */
+	bool a_contended;		/* The lock was held when it began */
+#endif
 };
 
 struct hangman_lockable {
 	const char *l_name;
 	const struct hangman_actor *l_holding;
+#if OPT_LOCKPROF
+	struct lockprof_class *l_prof;	/* Stats for l_name, set on first use */
+	uint32_t l_acquired;		/* Cycle count when last acquired */
+	unsigned l_acqcpu;		/* ...on this cpu */
+	unsigned l_acqclock;		/* ...at this c_hardclocks */
+	volatile bool l_held;
+#endif
 };
 
-void hangman_wait(struct hangman_actor *a, struct hangman_lockable *l);
-void hangman_acquire(struct hangman_actor *a, struct hangman_lockable *l);
-void hangman_release(struct hangman_actor *a, struct hangman_lockable *l);
-
 #define HANGMAN_ACTOR(sym)	struct hangman_actor sym
 #define HANGMAN_LOCKABLE(sym)	struct hangman_lockable sym
 
+#if OPT_LOCKPROF
+#define HANGMAN_ACTORINIT(a, n)	    ((a)->a_name = (n), (a)->a_waiting = NULL)
+#define HANGMAN_LOCKABLEINIT(l, n)  ((l)->l_name = (n), (l)->l_holding = NULL, \
+				     (l)->l_prof = NULL, (l)->l_held = false)
+#define HANGMAN_LOCKABLE_INITIALIZER_NAMED(n)	{ n, NULL, NULL, 0, 0, 0, false }
+#else
 #define HANGMAN_ACTORINIT(a, n)	    ((a)->a_name = (n), (a)->a_waiting = NULL)
 #define HANGMAN_LOCKABLEINIT(l, n)  ((l)->l_name = (n), (l)->l_holding = NULL)
+#define HANGMAN_LOCKABLE_INITIALIZER_NAMED(n)	{ n, NULL }
+#endif
+
+#define HANGMAN_LOCKABLE_INITIALIZER	HANGMAN_LOCKABLE_INITIALIZER_NAMED("spinlock")
 
-#define HANGMAN_LOCKABLE_INITIALIZER	{ "spinlock", NULL }
+#endif /* OPT_HANGMAN || OPT_LOCKPROF */
+
+#if OPT_HANGMAN
+void hangman_wait(struct hangman_actor *a, struct hangman_lockable *l);
+void hangman_acquire(struct hangman_actor *a, struct hangman_lockable *l);
+void hangman_release(struct hangman_actor *a, struct hangman_lockable *l);
+#endif
+
+#if OPT_LOCKPROF
+void lockprof_wait(struct hangman_actor *a, struct hangman_lockable *l);
+void lockprof_acquire(struct hangman_actor *a, struct hangman_lockable *l);
+void lockprof_release(struct hangman_actor *a, struct hangman_lockable *l);
+#endif
+
+#if OPT_HANGMAN && OPT_LOCKPROF
+
+#define HANGMAN_WAIT(a, l)	(hangman_wait(a, l), lockprof_wait(a, l))
+#define HANGMAN_ACQUIRE(a, l)	(hangman_acquire(a, l), lockprof_acquire(a, l))
+#define HANGMAN_RELEASE(a, l)	(lockprof_release(a, l), hangman_release(a, l))
+
+#elif OPT_HANGMAN
 
 #define HANGMAN_WAIT(a, l)	hangman_wait(a, l)
 #define HANGMAN_ACQUIRE(a, l)	hangman_acquire(a, l)
 #define HANGMAN_RELEASE(a, l)	hangman_release(a, l)
 
+#elif OPT_LOCKPROF
+
+#define HANGMAN_WAIT(a, l)	lockprof_wait(a, l)
+#define HANGMAN_ACQUIRE(a, l)	lockprof_acquire(a, l)
+#define HANGMAN_RELEASE(a, l)	lockprof_release(a, l)
+
 #else
 
 #define HANGMAN_ACTOR(sym)
@@ -74,6 +125,7 @@ void hangman_release(struct hangman_actor *a, struct hangman_lockable *l);
 #define HANGMAN_LOCKABLEINIT(a, name)
 
 #define HANGMAN_LOCKABLE_INITIALIZER
+#define HANGMAN_LOCKABLE_INITIALIZER_NAMED(n)
 
 #define HANGMAN_WAIT(a, l)
 #define HANGMAN_ACQUIRE(a, l)
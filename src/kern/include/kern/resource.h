@@ -67,6 +67,14 @@ struct rusage {
 	__counter_t ru_nsignals;	/* signals delivered (count) */
 	__counter_t ru_nvcsw;		/* voluntary context switches (count)*/
 	__counter_t ru_nivcsw;		/* involuntary ditto (count) */
+
+	/* OS/161 extensions: VM usage broken down by fault source */
+	__counter_t ru_tlbfaults;	/* TLB faults (count) */
+	__counter_t ru_zerofill;	/* demand-zero page faults (count) */
+	__counter_t ru_elfload;		/* pages loaded from the executable */
+	__counter_t ru_swapin;		/* pages loaded from swap (count) */
+	__counter_t ru_swapout;		/* pages evicted to make room (count) */
+	__size_t ru_rss;		/* current RSS (kb) */
 };
 
 /* limit codes for getrusage/setrusage */
@@ -0,0 +1,81 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches ("slab" allocator) for fixed-size kernel objects.
+ *
+ * Each cache carves whole pages (slabs) into objects of one size, so
+ * there is no rounding up to the kmalloc power-of-two buckets, and
+ * finding the slab of a freed object is just a mask of its address.
+ * Each CPU also keeps a small magazine of recently freed objects, so
+ * that most allocations and frees do not take the cache lock at all.
+ *
+ * If a constructor is given, it is called once on each object when its
+ * slab is created, not on every allocation. Objects must therefore be
+ * given back to the cache in their constructed state.
+ */
+
+#include <spinlock.h>
+#include <platform/maxcpus.h>
+
+/* Number of objects each CPU keeps in its magazine. */
+#define KMEM_MAGAZINE_SIZE 8
+
+struct kmem_slab;
+struct kmem_magazine;
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_objsize;		/* Rounded-up object size */
+	void (*kc_ctor)(void *obj);	/* Optional constructor */
+
+	struct spinlock kc_lock;	/* Protects everything below */
+	struct kmem_slab *kc_partial;	/* Slabs with free objects */
+	struct kmem_slab *kc_full;	/* Slabs with no free objects */
+	unsigned kc_nslabs;		/* Total slabs */
+	unsigned kc_nempty;		/* Slabs with every object free */
+	unsigned kc_nalloc;		/* Objects out of slabs (incl. magazines) */
+	struct kmem_cache *kc_next;	/* All caches, for stats and reclaim */
+	bool kc_listed;			/* True once on the list of caches */
+	unsigned kc_refs;		/* kmem_cache_reap_all walkers on it */
+	bool kc_dying;			/* Destroyed while kc_refs > 0 */
+
+	/* Per-cpu magazines, allocated the first time each cpu uses them. */
+	struct kmem_magazine *kc_mag[MAXCPUS];
+};
+
+/*
+ * Initializer for caches that are static or global (these need no
+ * bootstrap and can be used as early as kmalloc can).
+ */
+#define KMEM_CACHE_INITIALIZER(name, size, ctor) \
+	{ name, ((size) + 7) & ~(size_t)7, ctor, \
+	  SPINLOCK_INITIALIZER_NAMED("kc_lock"), NULL, NULL, 0, 0, 0, NULL, false, 0, false, { NULL } }
+
+/*
+ * Functions.
+ *
+ * kmem_cache_create  - allocate a new cache for objects of size SIZE.
+ * kmem_cache_destroy - destroy a cache made by kmem_cache_create.
+ *                      Every object must have been freed.
+ * kmem_cache_alloc   - get an object; returns NULL if out of memory.
+ * kmem_cache_free    - give back an object taken from the same cache.
+ * kmem_cache_reap    - release the completely free slabs of a cache
+ *                      (and this cpu's magazine); returns the number
+ *                      of pages released.
+ * kmem_cache_reap_all - reap all the caches until NPAGES pages have
+ *                      been released; returns the pages released.
+ *                      Only this cpu's magazines are flushed.
+ * kmem_cache_printstats - print usage of all the caches in use.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_cache_reap(struct kmem_cache *kc);
+unsigned kmem_cache_reap_all(unsigned npages);
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_CACHE_H_ */
@@ -125,6 +125,8 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * kheap_printprof prints the allocation profile, which is always
+ * collected; kheap_resetprof clears it.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +134,8 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_printprof(void);
+void kheap_resetprof(void);
 
 /*
  * C string functions.
@@ -0,0 +1,36 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiler. Enable with "options lockprof" in the
+ * kernel config; dump from the kernel menu with "lockprof".
+ *
+ * It runs on the deadlock detector hooks (see hangman.h) of spinlocks
+ * and sleep locks. Statistics are kept per lock name, so that e.g. the
+ * pt_lock of every address space adds up into one line, and per cpu,
+ * so that the hooks do not need a lock of their own.
+ *
+ * Wait and hold times are in cycles. The cycle counter is per cpu and
+ * restarts at every hardclock, so an interval that moves to another
+ * cpu or spans a hardclock is not timed; it is counted as "long"
+ * instead. Spinlocks are held with interrupts off and are always timed.
+ */
+
+#include "opt-lockprof.h"
+
+#if OPT_LOCKPROF
+
+#define LOCKPROF_CLASSES 48	/* Distinct lock names tracked */
+#define LOCKPROF_NAMELEN 24	/* Longer names are truncated */
+
+/*
+ * lockprof_print - print the statistics of every lock name seen,
+ *                  most waited for first.
+ * lockprof_reset - zero the statistics (names are kept).
+ */
+void lockprof_print(void);
+void lockprof_reset(void);
+
+#endif /* OPT_LOCKPROF */
+
+#endif /* _LOCKPROF_H_ */
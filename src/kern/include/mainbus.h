@@ -52,6 +52,17 @@ void mainbus_interrupt(struct trapframe *);
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
 
+/*
+ * Stop and restart the periodic timer interrupt (hardclock) of the
+ * current CPU, for idling without ticks. Any interrupt that arrives in
+ * between still wakes the CPU up.
+ */
+void mainbus_hardclock_stop(void);
+void mainbus_hardclock_start(void);
+
+/* Cycle counter ticks per hardclock; the counter restarts at each one. */
+uint32_t mainbus_cycles_per_hardclock(void);
+
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
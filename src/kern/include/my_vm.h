@@ -1,9 +1,12 @@
 #ifndef _MY_VM_H_
 #define _MY_VM_H_
 
+struct addrspace;
+
 void vm_bootstrap(void);
 void vm_shutdown(void);
 void vm_tlbshootdown(const struct tlbshootdown *ts);
 void vm_can_sleep(void);
+void pt_wake_transit(struct addrspace *as);
 
 #endif 
\ No newline at end of file
@@ -40,11 +40,29 @@
 #include <limits.h>
 #include "opt-waitpid.h"
 #include "opt-file.h"
+#include "opt-paging.h"
 
 struct addrspace;
 struct thread;
 struct vnode;
 
+#if OPT_PAGING
+/*
+ * Per-process VM counters. They are only updated by the thread of the
+ * process itself (in vm_fault), so they need no lock; they are added to
+ * the global vmstats when the process is destroyed.
+ */
+struct proc_vmstats {
+	unsigned pv_tlb_faults;		/* TLB faults handled by vm_fault */
+	unsigned pv_tlb_cache_hits;	/* TLB faults solved from the TLB cache */
+	unsigned pv_tlb_reloads;	/* faults on pages already in memory */
+	unsigned pv_faults_zeroed;	/* demand-zero page faults */
+	unsigned pv_faults_elf;		/* page faults loaded from the ELF file */
+	unsigned pv_faults_swapfile;	/* page faults loaded from swap */
+	unsigned pv_swapouts;		/* pages evicted to make room for ours */
+};
+#endif
+
 /*
  * Process structure.
  *
@@ -83,6 +101,10 @@ struct proc {
 #if OPT_FILE
 	struct openfile *fileTable[OPEN_MAX];
 #endif
+
+#if OPT_PAGING
+	struct proc_vmstats p_vmstats;
+#endif
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
@@ -119,4 +141,10 @@ struct proc *proc_search_pid(pid_t pid);
 void proc_file_table_copy(struct proc *psrc, struct proc *pdest);
 #endif
 
+#if OPT_PAGING
+/* Fill in a struct rusage with the VM usage of the current process */
+struct rusage;
+void proc_getrusage(struct rusage *ru);
+#endif
+
 #endif /* _PROC_H_ */
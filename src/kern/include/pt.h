@@ -6,29 +6,39 @@
 #define PT_ENTRY_EMPTY 0
 #define PT_ENTRY_SWAPPED_OUT 1
 #define PT_ENTRY_VALID 2
+#define PT_ENTRY_IN_TRANSIT 3
+#define PT_ENTRY_ZERO 4
 
 typedef struct _pt_entry {
-    uint8_t status;         // Page table entry status: not-initialized (0), swapped-out (1), valid (2)
+    uint8_t status;         // Page table entry status: not-initialized (0), swapped-out (1), valid (2), in-transit (3), zero (4)
     paddr_t paddr;          // Memory physical address
     uint32_t perm;          // Page permissions: RWX
     off_t swapfile_offset;  // Page offset in the SWAPFILE
+    uint8_t swap_cached;    // Valid page still clean, its copy at swapfile_offset is up to date
 } pt_entry;
 
 typedef struct _pagetable {
     uint32_t num_pages1;     // Number of pages in the page table 1
     uint32_t num_pages2;     // Number of pages in the page table 2
+    uint32_t num_pages3;     // Number of pages in the page table 3 (stack)
     vaddr_t start_vaddr1;    // Page table start address 1
     vaddr_t start_vaddr2;    // Page table start address 2
+    vaddr_t start_vaddr3;    // Page table start address 3 (stack)
     pt_entry* pages;        // Page table entries
 } pagetable;
 
 
-pagetable *pt_init(vaddr_t pt_start_vaddr1, uint32_t pt_num_pages1, vaddr_t pt_start_vaddr2, uint32_t pt_num_pages2);
+pagetable *pt_init(vaddr_t pt_start_vaddr1, uint32_t pt_num_pages1, vaddr_t pt_start_vaddr2, uint32_t pt_num_pages2, vaddr_t pt_start_vaddr3, uint32_t pt_num_pages3);
 int pt_copy(pagetable *old, pagetable **ret);
 void pt_add_entry(pagetable *pt, vaddr_t vaddr, paddr_t paddr, uint32_t perm);
 uint8_t pt_get_page(pagetable *pt, vaddr_t vaddr, paddr_t *paddr, uint32_t *perm);
-void pt_swap_in(pagetable *pt, vaddr_t vaddr, paddr_t paddr, uint32_t perm);
+void pt_swap_in(pagetable *pt, vaddr_t vaddr, paddr_t paddr, uint32_t perm, int swap_cached);
 void pt_swap_out(pagetable *pt, vaddr_t vaddr, off_t swapfile_offset);
+void pt_set_in_transit(pagetable *pt, vaddr_t vaddr);
+void pt_set_zero(pagetable *pt, vaddr_t vaddr);
+int pt_get_swap_cache(pagetable *pt, vaddr_t vaddr, off_t *swapfile_offset);
+void pt_drop_swap_cache(pagetable *pt, vaddr_t vaddr);
+void pt_free_swap_slots(pagetable *pt);
 void pt_destroy(pagetable *pt);
 off_t pt_get_page_swapfile_offset(pagetable *pt, vaddr_t vaddr);
 
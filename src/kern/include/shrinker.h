@@ -0,0 +1,28 @@
+#ifndef _SHRINKER_H_
+#define _SHRINKER_H_
+
+#include <types.h>
+
+/*
+ * Memory pressure callbacks.
+ * Subsystems holding memory they can give back (caches, compressed pages)
+ * register a shrinker; when the page allocator runs out of frames it calls
+ * them before failing the request.
+ */
+
+struct shrinker {
+    const char *name;
+    //releases memory, trying for at least npages pages; returns the pages actually freed
+    //called from inside the page allocator, where the caller may hold sleep locks:
+    //must not sleep or do I/O (hand such work to a thread of its own instead)
+    unsigned int (*shrink)(unsigned int npages);
+    struct shrinker *next;
+};
+
+void shrinker_init(void);
+void shrinker_shutdown(void);
+void shrinker_register(struct shrinker *s);
+void shrinker_unregister(struct shrinker *s);
+unsigned int shrinker_run(unsigned int npages);
+
+#endif
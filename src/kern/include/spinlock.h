@@ -58,32 +58,56 @@
 struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	volatile spinlock_data_t splk_next; /* Next ticket (ticket locks). */
+	bool splk_ticket;		    /* Ticket lock? */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
 };
 
+/*
+ * A spinlock is either a plain test-and-set lock or, if made with
+ * spinlock_init_ticket or SPINLOCK_TICKET_INITIALIZER_NAMED, a ticket
+ * lock. A ticket lock is handed to waiting cpus in the order they
+ * arrived, and they spin only reading the lock word, which is better
+ * for locks that several cpus fight over. For locks that are seldom
+ * contended test-and-set is a little cheaper.
+ */
+
 /*
  * Initializer for cases where a spinlock needs to be static or global.
+ * The _NAMED forms give it a name for the deadlock detector and the
+ * lock profiler; otherwise it is just "spinlock".
  */
-#ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#if OPT_HANGMAN || OPT_LOCKPROF
+#define SPINLOCK_INITIALIZER_KIND(n, t)	{ SPINLOCK_DATA_INITIALIZER, NULL, \
+					  SPINLOCK_DATA_INITIALIZER, t, \
+					  HANGMAN_LOCKABLE_INITIALIZER_NAMED(n) }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER_KIND(n, t)	{ SPINLOCK_DATA_INITIALIZER, NULL, \
+					  SPINLOCK_DATA_INITIALIZER, t }
 #endif
+#define SPINLOCK_INITIALIZER_NAMED(n)	SPINLOCK_INITIALIZER_KIND(n, false)
+#define SPINLOCK_TICKET_INITIALIZER_NAMED(n) SPINLOCK_INITIALIZER_KIND(n, true)
+#define SPINLOCK_INITIALIZER	SPINLOCK_INITIALIZER_NAMED("spinlock")
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_ticket	Same, but make it a ticket lock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setname	Name the lock for the deadlock detector and the lock
+ *		profiler. NAME is not copied. Call after init.
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_ticket(struct spinlock *lk);
+void spinlock_setname(struct spinlock *lk, const char *name);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
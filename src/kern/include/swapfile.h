@@ -9,7 +9,8 @@
 int swapfile_init(void);
 int swapfile_close(void);
 int swap_out(paddr_t paddr, off_t *swap_offset);
-int swap_in(paddr_t paddr, off_t swap_offset);          
+int swap_in(paddr_t paddr, off_t swap_offset, int *swap_cached);          
+void swap_write_slot(unsigned int index, void *kbuf);
 int process_swap_free(off_t swap_offset);             
 
 #endif
\ No newline at end of file
@@ -38,7 +38,7 @@
 #include <spinlock.h>
 
 #include "opt-synch.h"
-#define USE_SEMAPHORE_FOR_LOCK 1
+#define USE_SEMAPHORE_FOR_LOCK 0
 
 /*
  * Dijkstra-style semaphore.
@@ -74,6 +74,15 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * The lock is adaptive: a thread that finds it held spins while the
+ * holder is running on another cpu, since it is likely to release it
+ * soon, and sleeps only if the holder is not running (or the spin
+ * goes on too long). The counters are updated under lk_lock.
+ *
+ * If there are sleepers, lock_release hands the lock straight to one
+ * of them (lk_owner is set before it wakes) rather than letting it
+ * wake up and try again.
  */
 struct lock {
         char *lk_name;
@@ -87,7 +96,12 @@ struct lock {
         struct wchan *lk_wchan;
 #endif
         struct spinlock lk_lock;
-        volatile struct thread *lk_owner;
+        struct thread *volatile lk_owner;       /* Polled without lk_lock */
+        unsigned lk_acquires;           /* Times acquired */
+        unsigned lk_contended;          /* ...of which found it held */
+        unsigned lk_spun;               /* ...of which got it by spinning */
+        unsigned lk_slept;              /* Times a waiter went to sleep */
+        unsigned lk_handoffs;           /* Releases that handed it over */
 #endif
 };
 
@@ -109,6 +123,11 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Print the contention counters of a lock.
+ */
+void lock_printstats(struct lock *);
+
 
 /*
  * Condition variable.
@@ -129,6 +148,7 @@ struct cv {
 #if OPT_SYNCH
         struct spinlock cv_lock;
         struct wchan *cv_wchan;
+        struct lock *cv_lk;             /* Lock used by the waiters */
 #endif
 };
 
@@ -146,6 +166,12 @@ void cv_destroy(struct cv *);
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
  *
+ * Since the signaller holds the lock, a woken thread could only block
+ * on it right away. So cv_signal and cv_broadcast move the sleepers to
+ * the lock's wait channel instead ("wait morphing"), and they wake up
+ * when lock_release hands the lock over, one at a time. For this all
+ * the threads waiting on a CV at the same time must use the same lock.
+ *
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
@@ -153,4 +179,55 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers, or a single writer, may hold the lock. It is
+ * fair: once a writer is waiting, new readers wait behind it, and when
+ * a writer releases the lock it is handed to all the readers waiting
+ * at that moment before any other writer gets it. So neither side can
+ * starve the other.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+        char *rwlock_name;
+#if OPT_SYNCH
+        struct spinlock rw_lock;        /* Protects everything below */
+        struct wchan *rw_rwchan;        /* Waiting readers */
+        struct wchan *rw_wwchan;        /* Waiting writers */
+        unsigned rw_readers;            /* Readers holding the lock */
+        struct thread *rw_writer;       /* Writer holding the lock */
+        unsigned rw_rwaiting;           /* Readers asleep, not yet let in */
+        unsigned rw_wwaiting;           /* Writers asleep */
+        unsigned rw_rgrant;             /* Readers let in but not yet awake */
+#endif
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. If nobody holds it
+ *                           for writing or waits to, this only takes
+ *                           the internal spinlock.
+ *    rwlock_release_read  - Free a read hold.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Free the write hold.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing. (Readers are not
+ *                           tracked individually.)
+ *
+ * Read holds do not nest: a reader that tries to read-acquire again
+ * while a writer is waiting deadlocks.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -34,6 +34,7 @@
 #include <cdefs.h> /* for __DEAD */
 #include "opt-syscalls.h"
 #include "opt-file.h"
+#include "opt-paging.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -75,6 +76,12 @@ int sys_close(int fd);
 int sys_write(int fd, userptr_t buf_ptr, size_t size);
 int sys_read(int fd, userptr_t buf_ptr, size_t size);
 void sys__exit(int status);
+#if OPT_PAGING
+int sys_getrusage(int who, userptr_t usage);
+#endif
+int sys_getpriority(int which, int who, int *retval);
+int sys_setpriority(int which, int who, int prio);
+int sys_setaffinity(int who, unsigned mask);
 #endif
 
 #endif /* _SYSCALL_H_ */
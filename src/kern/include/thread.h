@@ -84,6 +84,11 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
+	unsigned t_sched_level;		/* Scheduler level, 0 is highest */
+	unsigned t_sched_ticks;		/* Hardclocks used of the quantum */
+	unsigned t_ran_at;		/* c_hardclocks when last switched out */
+	int t_nice;			/* Static priority, PRIO_MIN..PRIO_MAX */
+	uint32_t t_affinity;		/* One bit for each cpu it may run on */
 
 	/*
 	 * Interrupt state fields.
@@ -158,11 +163,35 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for one hardclock. Returns true if it has
+ * used up its quantum, or a higher priority thread is waiting, and it
+ * should yield. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Get and set the static priority (nice value) of the current thread,
+ * from PRIO_MIN (highest) to PRIO_MAX (lowest); out of range values
+ * are clamped. Threads forked afterwards inherit it.
+ */
+int thread_getnice(void);
+void thread_setnice(int nice);
+
+/*
+ * Restrict the current thread to the cpus whose bits are set in MASK
+ * (bit N is cpu N); threads forked afterwards inherit it. Bits of cpus
+ * that do not exist are ignored. If the current cpu is not allowed the
+ * thread moves before returning. Returns EINVAL if no cpu is left, or
+ * ENOMEM.
+ */
+int thread_setaffinity(uint32_t mask);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -1,9 +1,22 @@
 #ifndef _VM_TLB_H_
 #define _VM_TLB_H_
 
-int tlb_get_rr_victim(void);
+struct addrspace;
+
+// TLB slots kept for pinned pages (at most 8, the slots below the c0_random range)
+#define TLB_WIRED_SLOTS 4
+
+int tlb_get_victim(uint32_t entryhi, int *was_free);
 void tlb_load(uint32_t entryhi, uint32_t entrylo, uint32_t perm);
 void tlb_invalidate(void);
+void tlb_set_wired(const vaddr_t *vpns, unsigned int n);
 void tlb_invalidate_entry(vaddr_t vaddr);
+void tlb_shootdown(vaddr_t vaddr, unsigned int npages);
+void tlb_set_dirty(vaddr_t vaddr, paddr_t paddr);
+int tlb_cache_refill(struct addrspace *as, vaddr_t vaddr);
+void tlb_cache_insert(struct addrspace *as, vaddr_t vaddr, paddr_t paddr, uint32_t perm);
+unsigned int tlb_cache_hits(unsigned int *with_free);
+void tlb_replacement_stats(unsigned int *evictions, unsigned int *premature, unsigned int *avg_age);
+void tlb_load_stats(unsigned int *with_free, unsigned int *with_replace, unsigned int *invalidations);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,25 @@
+#ifndef _VMALLOC_H_
+#define _VMALLOC_H_
+
+#include <types.h>
+#include <vm.h>
+
+/*
+ * Virtually contiguous kernel allocations.
+ * Large kmalloc requests that cannot find a run of contiguous physical frames
+ * are built from single scattered frames and mapped through the TLB in kseg2.
+ */
+
+//kseg2 window used for these mappings (4 MB)
+#define VMALLOC_START MIPS_KSEG2
+#define VMALLOC_NPAGES 1024
+#define VMALLOC_END (VMALLOC_START + VMALLOC_NPAGES * PAGE_SIZE)
+
+#define VMALLOC_ADDR(va) ((vaddr_t)(va) >= VMALLOC_START && (vaddr_t)(va) < VMALLOC_END)
+
+void *vmalloc(unsigned npages);
+void vfree(void *ptr);
+unsigned vmalloc_getsize(const void *ptr);
+int vmalloc_fault(int faulttype, vaddr_t faultaddress);
+
+#endif
@@ -13,14 +13,53 @@ enum {
     VMSTATS_PAGE_FAULTS_DISK,
     VMSTATS_PAGE_FAULTS_ELF,
     VMSTATS_PAGE_FAULTS_SWAPFILE,
-    VMSTATS_SWAPFILE_WRITES
+    VMSTATS_SWAPFILE_WRITES,
+    VMSTATS_ZSWAP_STORES,
+    VMSTATS_ZSWAP_LOADS,
+    VMSTATS_ZSWAP_REJECTS,
+    VMSTATS_ZSWAP_POOL_FULL,
+    VMSTATS_ZSWAP_COMPRESSED_BYTES,
+    VMSTATS_ZERO_PAGES,
+    VMSTATS_SWAP_CACHE_CLEAN_EVICTIONS,
+    VMSTATS_TLB_CACHE_HITS,
+    VMSTATS_SHRINKER_RUNS,
+    VMSTATS_SHRINKER_PAGES,
+    VMSTATS_ZSWAP_WRITEBACKS,
+    VMSTATS_TLB_PREMATURE_EVICTIONS,
+    VMSTATS_TLB_EVICTED_AGE,
+    VMSTATS_ZSWAP_ALLOC_FAILS
 };
 
-#define VMSTATS_NUM 10
+#define VMSTATS_NUM 24
+
+// vm_fault resolution paths timed by vmstats_latency()
+enum {
+    VMSTATS_LAT_CACHE,
+    VMSTATS_LAT_RELOAD,
+    VMSTATS_LAT_ZERO,
+    VMSTATS_LAT_ELF,
+    VMSTATS_LAT_SWAPFILE
+};
+
+#define VMSTATS_LAT_NUM 5
+#define VMSTATS_LAT_BUCKETS 32      // bucket i counts latencies in [2^i, 2^(i+1)) cycles (bucket 0 also 0)
+
+// start of a timed fault: the cycle counter is per CPU and restarts at every hardclock,
+// so two readings can only be compared on the same CPU, adding a tick for each hardclock in between
+struct vmstats_stamp {
+    unsigned int cpu;
+    unsigned int hardclocks;
+    uint32_t cycles;
+};
 
 void vmstats_init(void);
 void vmstats_increment(uint8_t stats_type);
+void vmstats_add(uint8_t stats_type, unsigned int amount);
+void vmstats_stamp(struct vmstats_stamp *s);
+int vmstats_elapsed(const struct vmstats_stamp *start, uint32_t *cycles);
+void vmstats_latency(unsigned int path, const struct vmstats_stamp *start);
 void vmstats_print(void);
+void vmstats_printlocks(void);
 void vmstats_destroy(void);
 
 
@@ -0,0 +1,58 @@
+#ifndef _VMTRACE_H_
+#define _VMTRACE_H_
+
+#include <types.h>
+#include <vmstats.h>
+#include "opt-vmtrace.h"
+
+/*
+ * VM event tracing: every user TLB fault is recorded, with how it was
+ * resolved and how long it took, in a per-CPU ring of binary records.
+ * The rings are dumped to a file from the kernel menu ("vmtrace dump")
+ * and decoded on the host by testscripts/vmtrace.py.
+ */
+
+//resolution path of a fault
+#define VMTRACE_CACHE   0       // refilled from the software TLB cache
+#define VMTRACE_RELOAD  1       // page already in memory
+#define VMTRACE_ZERO    2       // demand-zero fill
+#define VMTRACE_ELF     3       // loaded from the executable
+#define VMTRACE_SWAP    4       // read back from swap (file or compressed pool)
+#define VMTRACE_DIRTY   5       // first write to a swap-cached page
+
+//record flags
+#define VMTRACE_UNTIMED 0x01    // fault moved to another CPU: latency unknown
+
+//records kept by each CPU, older ones are overwritten
+#define VMTRACE_RECORDS 1024
+
+#define VMTRACE_MAGIC 0x564d5452        // "VMTR"
+#define VMTRACE_VERSION 2
+#define VMTRACE_DEFAULT_FILE "emu0:/VMTRACE"
+
+//on-disk layout too (big-endian, as the target)
+//the cycle counter restarts at every hardclock, so the time a fault was taken is (hardclocks, cycles)
+struct vmtrace_record {
+    uint32_t hardclocks;        // hardclock ticks of cpu when the fault was taken
+    uint32_t cycles;            // cycle counter within that tick
+    uint32_t latency;           // cycles spent in vm_fault, 0 if VMTRACE_UNTIMED
+    uint32_t vaddr;             // faulting address
+    uint32_t victim;            // page evicted to make room, 0 if none
+    int32_t pid;                // faulting process, -1 if unknown
+    uint8_t faulttype;          // VM_FAULT_*
+    uint8_t path;               // VMTRACE_*
+    uint8_t cpu;                // cpu the fault was taken on
+    uint8_t flags;              // VMTRACE_UNTIMED
+};
+
+#if OPT_VMTRACE
+void vmtrace_record(int faulttype, vaddr_t vaddr, int path, vaddr_t victim, const struct vmstats_stamp *start);
+void vmtrace_printstats(void);
+void vmtrace_clear(void);
+int vmtrace_dump(const char *path);
+#else
+#define vmtrace_record(faulttype, vaddr, path, victim, start) \
+    ((void)(faulttype), (void)(vaddr), (void)(path), (void)(victim), (void)(start))
+#endif
+
+#endif
@@ -36,6 +36,7 @@
 
 
 struct spinlock; /* in spinlock.h */
+struct thread; /* in thread.h */
 struct wchan; /* Opaque */
 
 /*
@@ -72,9 +73,24 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
  *
  * The current implementation is FIFO but this is not promised by the
  * interface.
+ *
+ * wchan_wakeone returns the thread it woke, or NULL if there was none.
+ * The thread cannot return from wchan_sleep until the spinlock is
+ * released, so until then the caller may, e.g., hand it something.
  */
-void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
+struct thread *wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Move one thread (the one wchan_wakeone would wake), or all threads,
+ * sleeping on FROM to TO without waking them. Both spinlocks must be
+ * locked. The threads still return from wchan_sleep on FROM, and
+ * relock FROMLK, once woken from TO.
+ */
+void wchan_moveone(struct wchan *from, struct spinlock *fromlk,
+		   struct wchan *to, struct spinlock *tolk);
+void wchan_moveall(struct wchan *from, struct spinlock *fromlk,
+		   struct wchan *to, struct spinlock *tolk);
+
 
 #endif /* _WCHAN_H_ */
@@ -0,0 +1,24 @@
+#ifndef ZSWAP_H
+#define ZSWAP_H
+
+#include <types.h>
+
+/*
+ * Compressed in-memory tier placed in front of the swapfile.
+ * Entries are keyed by swapfile slot index, so page table entries keep
+ * storing a plain swap offset regardless of where the page really lives.
+ */
+
+//max share of physical memory (in percent) used to hold compressed pages
+#define ZSWAP_POOL_PERCENT 25
+
+//pages that do not compress below this size are written to the swapfile
+#define ZSWAP_MAX_COMPRESSED_SIZE (PAGE_SIZE / 2)
+
+int zswap_init(unsigned int nslots);
+void zswap_close(void);
+int zswap_store(unsigned int index, paddr_t paddr);
+int zswap_load(unsigned int index, paddr_t paddr);
+void zswap_invalidate(unsigned int index);
+
+#endif
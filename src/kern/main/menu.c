@@ -29,7 +29,9 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
 #include <kern/reboot.h>
+#include <kern/resource.h>
 #include <kern/unistd.h>
 #include <limits.h>
 #include <lib.h>
@@ -43,6 +45,10 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <kmem_cache.h>
+#include <vmtrace.h>
+#include <vmstats.h>
+#include <lockprof.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 
@@ -468,6 +474,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 
 	return 0;
 }
@@ -501,6 +508,108 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kheap_printprof();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kheap_resetprof();
+	}
+	else {
+		kprintf("Usage: khprof [reset]\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Command for running another menu command with a different static
+ * priority (nice value). Threads forked by the command inherit it;
+ * ours goes back to what it was afterwards.
+ */
+static int cmd_dispatch(char *cmd);
+
+static
+int
+cmd_nice(int nargs, char **args)
+{
+	int oldnice, result, i;
+
+	if (nargs < 3) {
+		kprintf("Usage: nice priority command [args...]\n");
+		kprintf("    priority is from %d (highest) to %d (lowest)\n",
+			PRIO_MIN, PRIO_MAX);
+		return EINVAL;
+	}
+
+	/* Put back the spaces strtok took out between the words */
+	for (i=2; i<nargs-1; i++) {
+		args[i][strlen(args[i])] = ' ';
+	}
+
+	oldnice = thread_getnice();
+	thread_setnice(atoi(args[1]));
+	result = cmd_dispatch(args[2]);
+	thread_setnice(oldnice);
+
+	return result;
+}
+
+#if OPT_VMTRACE
+static
+int
+cmd_vmtrace(int nargs, char **args)
+{
+	const char *path;
+	int result;
+
+	if (nargs == 1) {
+		vmtrace_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "clear")) {
+		vmtrace_clear();
+	}
+	else if ((nargs == 2 || nargs == 3) && !strcmp(args[1], "dump")) {
+		path = nargs == 3 ? args[2] : VMTRACE_DEFAULT_FILE;
+		result = vmtrace_dump(path);
+		if (result) {
+			kprintf("vmtrace: %s: %s\n", path, strerror(result));
+			return result;
+		}
+		kprintf("vmtrace: written to %s\n", path);
+	}
+	else {
+		kprintf("Usage: vmtrace [clear | dump [file]]\n");
+	}
+
+	return 0;
+}
+#endif
+
+#if OPT_LOCKPROF
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockprof_print();
+		kprintf("\nSleep locks:\n");
+		vmstats_printlocks();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+	}
+	else {
+		kprintf("Usage: lockprof [reset]\n");
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -543,6 +652,7 @@ static const char *opsmenu[] = {
 	"[debug]   Drop to debugger          ",
 	"[panic]   Intentional panic         ",
 	"[deadlock] Intentional deadlock     ",
+	"[nice]    Run a command at priority ",
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -577,6 +687,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[slt] Spinlock benchmark            ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -608,6 +719,13 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profile        ",
+#if OPT_VMTRACE
+	"[vmtrace] VM fault trace            ",
+#endif
+#if OPT_LOCKPROF
+	"[lockprof] Lock contention profile  ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -651,6 +769,7 @@ static struct {
 	{ "debug",	cmd_debug },
 	{ "panic",	cmd_panic },
 	{ "deadlock",	cmd_deadlock },
+	{ "nice",	cmd_nice },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
@@ -659,6 +778,13 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprof },
+#if OPT_VMTRACE
+	{ "vmtrace",    cmd_vmtrace },
+#endif
+#if OPT_LOCKPROF
+	{ "lockprof",   cmd_lockprof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -681,6 +807,7 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "slt",	spinlocktest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
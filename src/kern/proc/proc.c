@@ -48,6 +48,12 @@
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#if OPT_PAGING
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <coremap.h>
+#include <vmstats.h>
+#endif
 
 #if OPT_WAITPID
 #include <synch.h>
@@ -154,6 +160,7 @@ proc_create(const char *name)
 
 	proc->p_numthreads = 0;
 	spinlock_init(&proc->p_lock);
+	spinlock_setname(&proc->p_lock, "p_lock");
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -165,10 +172,33 @@ proc_create(const char *name)
 
 #if OPT_FILE
 	bzero(proc->fileTable, OPEN_MAX * sizeof(struct openfile *));
+#endif
+#if OPT_PAGING
+	bzero(&proc->p_vmstats, sizeof(proc->p_vmstats));
 #endif
 	return proc;
 }
 
+#if OPT_PAGING
+/*
+ * Add the VM counters of a dying process to the global ones.
+ * TLB cache hits are not added: the TLB code counts those per-cpu.
+ */
+static
+void
+proc_vmstats_merge(struct proc *proc)
+{
+	struct proc_vmstats *pv = &proc->p_vmstats;
+
+	vmstats_add(VMSTATS_TLB_FAULTS, pv->pv_tlb_faults);
+	vmstats_add(VMSTATS_TLB_RELOADS, pv->pv_tlb_reloads);
+	vmstats_add(VMSTATS_PAGE_FAULTS_ZEROED, pv->pv_faults_zeroed);
+	vmstats_add(VMSTATS_PAGE_FAULTS_ELF, pv->pv_faults_elf);
+	vmstats_add(VMSTATS_PAGE_FAULTS_DISK,
+		    pv->pv_faults_elf + pv->pv_faults_swapfile);
+}
+#endif
+
 /*
  * Destroy a proc structure.
  *
@@ -202,6 +232,9 @@ proc_destroy(struct proc *proc)
 	}
 
 	/* VM fields */
+#if OPT_PAGING
+	proc_vmstats_merge(proc);
+#endif
 	if (proc->p_addrspace) {
 		/*
 		 * If p is the current process, remove it safely from
@@ -271,6 +304,7 @@ proc_bootstrap(void)
 
 #if OPT_WAITPID
 	spinlock_init(&processTable.lk);
+	spinlock_setname(&processTable.lk, "processTable");
 	processTable.active = 1;
 #endif
 }
@@ -440,4 +474,38 @@ void proc_file_table_copy(struct proc *psrc, struct proc *pdest) {
 		}
 	}
 }
-#endif
\ No newline at end of file
+#endif
+
+#if OPT_PAGING
+/*
+ * Report the VM usage of the current process. Resident pages are
+ * counted on the spot from the coremap.
+ */
+void
+proc_getrusage(struct rusage *ru)
+{
+	struct proc_vmstats *pv = &curproc->p_vmstats;
+	struct addrspace *as;
+	unsigned resident = 0;
+
+	bzero(ru, sizeof(*ru));
+
+	ru->ru_tlbfaults = pv->pv_tlb_faults + pv->pv_tlb_cache_hits;
+	ru->ru_zerofill = pv->pv_faults_zeroed;
+	ru->ru_elfload = pv->pv_faults_elf;
+	ru->ru_swapin = pv->pv_faults_swapfile;
+	ru->ru_swapout = pv->pv_swapouts;
+
+	/* minor faults need no I/O, major ones read the page in */
+	ru->ru_minflt = pv->pv_tlb_cache_hits + pv->pv_tlb_reloads +
+		pv->pv_faults_zeroed;
+	ru->ru_majflt = pv->pv_faults_elf + pv->pv_faults_swapfile;
+	ru->ru_nswap = pv->pv_swapouts;
+
+	as = proc_getas();
+	if (as != NULL) {
+		resident = coremap_count_user_as(as);
+	}
+	ru->ru_rss = resident * (PAGE_SIZE / 1024);
+}
+#endif
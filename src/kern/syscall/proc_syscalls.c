@@ -20,6 +20,10 @@
 #include <synch.h>
 #endif
 
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+
 /*
  * simple proc management system calls
  */
@@ -42,3 +46,102 @@ sys__exit(int status)
   panic("thread_exit returned (should not happen)\n");
   (void) status; // TODO: status handling
 }
+
+/*
+ * getpriority/setpriority: static priority (nice value) of the calling
+ * process. A process has a single thread, so this is that thread's
+ * priority. Processes have no list of their threads, so other
+ * processes cannot be reached. As there are no privileged users, a
+ * process may only raise its nice value: lowering it would let it
+ * starve everybody else. Only the kernel (the "nice" menu command)
+ * hands out negative values.
+ */
+static
+int
+prio_check_target(int which, int who)
+{
+  if (which != PRIO_PROCESS) {
+    return EINVAL;
+  }
+#if OPT_WAITPID
+  if (who != 0 && who != curproc->p_pid) {
+    return ESRCH;
+  }
+#else
+  if (who != 0) {
+    return ESRCH;
+  }
+#endif
+  return 0;
+}
+
+int
+sys_getpriority(int which, int who, int *retval)
+{
+  int err;
+
+  err = prio_check_target(which, who);
+  if (err) {
+    return err;
+  }
+  *retval = thread_getnice();
+  return 0;
+}
+
+int
+sys_setpriority(int which, int who, int prio)
+{
+  int err;
+
+  err = prio_check_target(which, who);
+  if (err) {
+    return err;
+  }
+  if (prio < thread_getnice()) {
+    return EACCES;
+  }
+  thread_setnice(prio);
+  return 0;
+}
+
+/*
+ * setaffinity: restrict the calling process to the cpus whose bits
+ * are set in mask. As above, who is 0 or our own pid.
+ */
+int
+sys_setaffinity(int who, unsigned mask)
+{
+  int err;
+
+  err = prio_check_target(PRIO_PROCESS, who);
+  if (err) {
+    return err;
+  }
+  return thread_setaffinity(mask);
+}
+
+#if OPT_PAGING
+/*
+ * getrusage: VM usage of the calling process.
+ * There is no fork, so a process never has children to report:
+ * RUSAGE_CHILDREN gives back all zeroes.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+  struct rusage ru;
+
+  switch (who) {
+  case RUSAGE_SELF:
+    proc_getrusage(&ru);
+    break;
+  case RUSAGE_CHILDREN:
+    bzero(&ru, sizeof(ru));
+    break;
+  default:
+    return EINVAL;
+  }
+
+  return copyout(&ru, usage, sizeof(ru));
+}
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Spinlock microbenchmark.
+ *
+ * One thread pinned on each cpu takes and drops the same spinlock for
+ * a few seconds, once with a test-and-set lock and once with a ticket
+ * lock. For each we print how many times the lock was taken in all
+ * (throughput) and by each cpu (fairness). "again" is how often the
+ * cpu that just released the lock was also the next to get it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+#include <platform/maxcpus.h>
+
+#define SLT_SECONDS	2	/* length of each run */
+#define SLT_HOLD	20	/* loop iterations with the lock held */
+#define SLT_GAP		20	/* loop iterations between two acquires */
+
+static struct spinlock slt_lock;
+static struct semaphore *slt_sem;
+static volatile bool slt_go;
+static volatile bool slt_stop;
+
+/* protected by slt_lock */
+static volatile unsigned long slt_counter;
+static volatile unsigned long slt_again;
+static volatile unsigned long slt_lastcpu;
+
+static unsigned long slt_acquires[MAXCPUS];
+static bool slt_present[MAXCPUS];
+
+static
+void
+slt_worker(void *junk, unsigned long num)
+{
+	unsigned long n;
+	volatile unsigned i;
+
+	(void)junk;
+
+	if (thread_setaffinity(1U << num)) {
+		/* there is no cpu NUM */
+		slt_present[num] = false;
+		V(slt_sem);
+		return;
+	}
+	slt_present[num] = true;
+	V(slt_sem);
+
+	while (!slt_go) {
+		thread_yield();
+	}
+
+	n = 0;
+	while (!slt_stop) {
+		spinlock_acquire(&slt_lock);
+		slt_counter++;
+		if (slt_lastcpu == num) {
+			slt_again++;
+		}
+		slt_lastcpu = num;
+		for (i=0; i<SLT_HOLD; i++) {
+			/* work */
+		}
+		spinlock_release(&slt_lock);
+		n++;
+		for (i=0; i<SLT_GAP; i++) {
+			/* work */
+		}
+	}
+
+	slt_acquires[num] = n;
+	V(slt_sem);
+}
+
+static
+void
+slt_run(const char *kind, bool ticket)
+{
+	unsigned long total, min, max;
+	uint64_t sumsq, jain;
+	unsigned i, ncpus;
+	int result;
+
+	if (ticket) {
+		spinlock_init_ticket(&slt_lock);
+	}
+	else {
+		spinlock_init(&slt_lock);
+	}
+	spinlock_setname(&slt_lock, "slt_lock");
+	slt_go = false;
+	slt_stop = false;
+	slt_counter = 0;
+	slt_again = 0;
+	slt_lastcpu = MAXCPUS;
+
+	for (i=0; i<MAXCPUS; i++) {
+		slt_acquires[i] = 0;
+		result = thread_fork("slt", NULL, slt_worker, NULL, i);
+		if (result) {
+			panic("slt: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<MAXCPUS; i++) {
+		P(slt_sem);
+	}
+
+	ncpus = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		if (slt_present[i]) {
+			ncpus++;
+		}
+	}
+
+	slt_go = true;
+	clocksleep(SLT_SECONDS);
+	slt_stop = true;
+
+	for (i=0; i<ncpus; i++) {
+		P(slt_sem);
+	}
+	spinlock_cleanup(&slt_lock);
+
+	total = 0;
+	min = (unsigned long)-1;
+	max = 0;
+	sumsq = 0;
+	kprintf("%s:", kind);
+	for (i=0; i<MAXCPUS; i++) {
+		if (!slt_present[i]) {
+			continue;
+		}
+		kprintf(" %lu", slt_acquires[i]);
+		total += slt_acquires[i];
+		sumsq += (uint64_t)slt_acquires[i] * slt_acquires[i];
+		if (slt_acquires[i] < min) {
+			min = slt_acquires[i];
+		}
+		if (slt_acquires[i] > max) {
+			max = slt_acquires[i];
+		}
+	}
+	kprintf("\n");
+	KASSERT(total == slt_counter);
+
+	/*
+	 * Jain's fairness index, in thousandths: 1 if every cpu got
+	 * the same share, 1/ncpus if one got it all.
+	 */
+	jain = 0;
+	if (sumsq > 0) {
+		jain = (uint64_t)total * total * 1000 / (ncpus * sumsq);
+	}
+	kprintf("    %lu/s on %u cpus, min %lu max %lu, "
+		"fairness %llu.%03llu, again %lu%%\n",
+		total / SLT_SECONDS, ncpus, min, max,
+		jain / 1000, jain % 1000,
+		total == 0 ? 0 : slt_again * 100 / total);
+}
+
+int
+spinlocktest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	if (slt_sem == NULL) {
+		slt_sem = sem_create("slt_sem", 0);
+		if (slt_sem == NULL) {
+			panic("slt: sem_create failed\n");
+		}
+	}
+
+	kprintf("Starting spinlock test...\n");
+	slt_run("test-and-set", false);
+	slt_run("ticket", true);
+	kprintf("Spinlock test done.\n");
+
+	return 0;
+}
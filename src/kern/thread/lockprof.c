@@ -0,0 +1,279 @@
+/*
+ * Lock contention profiler. See lockprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <current.h>
+#include <hangman.h>
+#include <lockprof.h>
+
+struct lockprof_counts {
+	uint64_t lp_wait_cycles;	/* Total timed wait of contended acquires */
+	uint32_t lp_acquires;
+	uint32_t lp_contended;		/* Acquires that found the lock held */
+	uint32_t lp_long_waits;		/* Contended waits that were not timed */
+	uint32_t lp_long_holds;		/* Holds that were not timed */
+	uint32_t lp_max_hold;		/* Longest timed hold */
+};
+
+struct lockprof_class {
+	char lc_name[LOCKPROF_NAMELEN];
+	struct lockprof_counts lc_counts[MAXCPUS];
+};
+
+/*
+ * Classes are only ever added. Lookups read lockprof_nclasses without
+ * locking; additions are serialized by lockprof_table_lock, which is
+ * a bare spinlock word because the hooks of a struct spinlock would
+ * come back here. When the table is full, the last class takes every
+ * other name.
+ */
+static struct lockprof_class lockprof_classes[LOCKPROF_CLASSES];
+static volatile unsigned lockprof_nclasses;
+static volatile spinlock_data_t lockprof_table_lock = SPINLOCK_DATA_INITIALIZER;
+
+/* Scratch space for lockprof_print. */
+static struct lockprof_counts lockprof_totals[LOCKPROF_CLASSES];
+static bool lockprof_printed[LOCKPROF_CLASSES];
+
+/*
+ * Compare a lock name with a (possibly truncated) class name.
+ */
+static
+bool
+lockprof_samename(const char *classname, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKPROF_NAMELEN-1; i++) {
+		if (classname[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find the class for NAME, adding it if it is new.
+ */
+static
+struct lockprof_class *
+lockprof_getclass(const char *name)
+{
+	struct lockprof_class *lc;
+	unsigned i, n;
+	int spl;
+
+	if (name == NULL) {
+		name = "(unnamed)";
+	}
+
+	n = lockprof_nclasses;
+	for (i=0; i<n; i++) {
+		if (lockprof_samename(lockprof_classes[i].lc_name, name)) {
+			return &lockprof_classes[i];
+		}
+	}
+
+	spl = splhigh();
+	while (spinlock_data_testandset(&lockprof_table_lock) != 0) {
+		/* spin */
+	}
+
+	/* look again at the ones added since */
+	for (; i<lockprof_nclasses; i++) {
+		if (lockprof_samename(lockprof_classes[i].lc_name, name)) {
+			break;
+		}
+	}
+	if (i == lockprof_nclasses) {
+		if (i == LOCKPROF_CLASSES - 1) {
+			name = "(others)";
+		}
+		lc = &lockprof_classes[i];
+		for (n=0; n<LOCKPROF_NAMELEN-1 && name[n] != 0; n++) {
+			lc->lc_name[n] = name[n];
+		}
+		lc->lc_name[n] = 0;
+		if (i < LOCKPROF_CLASSES - 1) {
+			/* the name must be visible before the count */
+			membar_store_store();
+			lockprof_nclasses = i + 1;
+		}
+	}
+	lc = &lockprof_classes[i];
+
+	membar_any_store();
+	spinlock_data_set(&lockprof_table_lock, 0);
+	splx(spl);
+
+	return lc;
+}
+
+/*
+ * Hooks, called through HANGMAN_WAIT/ACQUIRE/RELEASE. A is the cpu
+ * for spinlocks and the thread for sleep locks.
+ */
+void
+lockprof_wait(struct hangman_actor *a, struct hangman_lockable *l)
+{
+	int spl;
+
+	spl = splhigh();
+	a->a_contended = l->l_held;
+	a->a_waitcpu = curcpu->c_number;
+	a->a_waitclock = curcpu->c_hardclocks;
+	a->a_waitstart = cpu_getcycles();
+	splx(spl);
+}
+
+void
+lockprof_acquire(struct hangman_actor *a, struct hangman_lockable *l)
+{
+	struct lockprof_counts *c;
+	uint32_t now;
+	int spl;
+
+	if (l->l_prof == NULL) {
+		l->l_prof = lockprof_getclass(l->l_name);
+	}
+
+	spl = splhigh();
+	now = cpu_getcycles();
+	c = &l->l_prof->lc_counts[curcpu->c_number];
+	c->lp_acquires++;
+	if (a->a_contended) {
+		c->lp_contended++;
+		if (a->a_waitcpu == curcpu->c_number &&
+		    a->a_waitclock == curcpu->c_hardclocks) {
+			c->lp_wait_cycles += now - a->a_waitstart;
+		}
+		else {
+			c->lp_long_waits++;
+		}
+	}
+	l->l_held = true;
+	l->l_acqcpu = curcpu->c_number;
+	l->l_acqclock = curcpu->c_hardclocks;
+	l->l_acquired = now;
+	splx(spl);
+}
+
+void
+lockprof_release(struct hangman_actor *a, struct hangman_lockable *l)
+{
+	struct lockprof_counts *c;
+	uint32_t hold;
+	int spl;
+
+	(void)a;
+
+	spl = splhigh();
+	if (l->l_prof != NULL) {
+		c = &l->l_prof->lc_counts[curcpu->c_number];
+		if (l->l_acqcpu == curcpu->c_number &&
+		    l->l_acqclock == curcpu->c_hardclocks) {
+			hold = cpu_getcycles() - l->l_acquired;
+			if (hold > c->lp_max_hold) {
+				c->lp_max_hold = hold;
+			}
+		}
+		else {
+			c->lp_long_holds++;
+		}
+	}
+	l->l_held = false;
+	splx(spl);
+}
+
+/*
+ * Print the totals over all cpus, the most waited-for names first.
+ * Contended waits that could not be timed are ranked after the timed
+ * ones, by count.
+ */
+void
+lockprof_print(void)
+{
+	struct lockprof_counts *t, *c;
+	unsigned i, j, n, best;
+
+	n = lockprof_nclasses;
+	if (n < LOCKPROF_CLASSES && lockprof_classes[n].lc_name[0] != 0) {
+		/* the "(others)" class is in use */
+		n++;
+	}
+
+	for (i=0; i<n; i++) {
+		t = &lockprof_totals[i];
+		bzero(t, sizeof(*t));
+		for (j=0; j<MAXCPUS; j++) {
+			c = &lockprof_classes[i].lc_counts[j];
+			t->lp_wait_cycles += c->lp_wait_cycles;
+			t->lp_acquires += c->lp_acquires;
+			t->lp_contended += c->lp_contended;
+			t->lp_long_waits += c->lp_long_waits;
+			t->lp_long_holds += c->lp_long_holds;
+			if (c->lp_max_hold > t->lp_max_hold) {
+				t->lp_max_hold = c->lp_max_hold;
+			}
+		}
+		lockprof_printed[i] = false;
+	}
+
+	kprintf("%-23s %10s %10s %14s %10s %10s %8s %8s\n",
+		"lock", "acquires", "contended",
+		"wait cycles", "avg wait", "max hold", "long wt", "long hd");
+	for (i=0; i<n; i++) {
+		best = n;
+		for (j=0; j<n; j++) {
+			if (lockprof_printed[j]) {
+				continue;
+			}
+			if (best == n ||
+			    lockprof_totals[j].lp_wait_cycles >
+			    lockprof_totals[best].lp_wait_cycles ||
+			    (lockprof_totals[j].lp_wait_cycles ==
+			     lockprof_totals[best].lp_wait_cycles &&
+			     lockprof_totals[j].lp_long_waits >
+			     lockprof_totals[best].lp_long_waits)) {
+				best = j;
+			}
+		}
+		lockprof_printed[best] = true;
+		t = &lockprof_totals[best];
+		if (t->lp_acquires == 0) {
+			continue;
+		}
+		kprintf("%-23s %10u %10u %14llu %10llu %10u %8u %8u\n",
+			lockprof_classes[best].lc_name,
+			t->lp_acquires, t->lp_contended,
+			(unsigned long long)t->lp_wait_cycles,
+			t->lp_contended > t->lp_long_waits ?
+			(unsigned long long)t->lp_wait_cycles /
+			(t->lp_contended - t->lp_long_waits) : 0ULL,
+			t->lp_max_hold, t->lp_long_waits, t->lp_long_holds);
+	}
+}
+
+void
+lockprof_reset(void)
+{
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	for (i=0; i<LOCKPROF_CLASSES; i++) {
+		bzero(lockprof_classes[i].lc_counts,
+		      sizeof(lockprof_classes[i].lc_counts));
+	}
+	splx(spl);
+}
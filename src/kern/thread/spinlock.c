@@ -52,9 +52,34 @@ spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
+	spinlock_data_set(&splk->splk_next, 0);
+	splk->splk_ticket = false;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
 
+/*
+ * Initialize a ticket spinlock. splk_next is the number the next cpu
+ * to come will take and splk_lock the number being served; the lock
+ * is free when they are equal.
+ */
+void
+spinlock_init_ticket(struct spinlock *splk)
+{
+	spinlock_init(splk);
+	splk->splk_ticket = true;
+}
+
+/*
+ * Name a spinlock; locks of the same name are profiled together.
+ */
+void
+spinlock_setname(struct spinlock *splk, const char *name)
+{
+	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, name);
+	(void)splk;
+	(void)name;
+}
+
 /*
  * Clean up spinlock.
  */
@@ -62,7 +87,13 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	if (splk->splk_ticket) {
+		KASSERT(spinlock_data_get(&splk->splk_lock) ==
+			spinlock_data_get(&splk->splk_next));
+	}
+	else {
+		KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	}
 }
 
 /*
@@ -76,6 +107,7 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,24 +125,36 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
+	if (splk->splk_ticket) {
 		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
+		 * Take a number and wait for it to be served. Only the
+		 * holder writes splk_lock, so waiters just read it.
 		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
+		ticket = spinlock_data_fetchinc(&splk->splk_next);
+		while (spinlock_data_get(&splk->splk_lock) != ticket) {
+			/* spin */
 		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
+	}
+	else {
+		while (1) {
+			/*
+			 * Do test-test-and-set, that is, read first before
+			 * doing test-and-set, to reduce bus contention.
+			 *
+			 * Test-and-set is a machine-level atomic operation
+			 * that writes 1 into the lock word and returns the
+			 * previous value. If that value was 0, the lock was
+			 * previously unheld and we now own it. If it was 1,
+			 * we don't.
+			 */
+			if (spinlock_data_get(&splk->splk_lock) != 0) {
+				continue;
+			}
+			if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+				continue;
+			}
+			break;
 		}
-		break;
 	}
 
 	membar_store_any();
@@ -137,7 +181,14 @@ spinlock_release(struct spinlock *splk)
 
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	if (splk->splk_ticket) {
+		/* serve the next number */
+		spinlock_data_set(&splk->splk_lock,
+				  spinlock_data_get(&splk->splk_lock) + 1);
+	}
+	else {
+		spinlock_data_set(&splk->splk_lock, 0);
+	}
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
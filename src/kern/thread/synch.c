@@ -37,8 +37,24 @@
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
+#include <membar.h>
 #include <synch.h>
+#include <kmem_cache.h>
+
+/*
+ * The synchronization objects themselves come from object caches;
+ * names and wait channels are allocated separately, as before.
+ */
+static struct kmem_cache sem_cache =
+	KMEM_CACHE_INITIALIZER("semaphore", sizeof(struct semaphore), NULL);
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock), NULL);
+static struct kmem_cache cv_cache =
+	KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv), NULL);
+static struct kmem_cache rwlock_cache =
+	KMEM_CACHE_INITIALIZER("rwlock", sizeof(struct rwlock), NULL);
 
 ////////////////////////////////////////////////////////////
 //
@@ -49,25 +65,26 @@ sem_create(const char *name, unsigned initial_count)
 {
         struct semaphore *sem;
 
-        sem = kmalloc(sizeof(*sem));
+        sem = kmem_cache_alloc(&sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(&sem_cache, sem);
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		kmem_cache_free(&sem_cache, sem);
 		return NULL;
 	}
 
 	spinlock_init(&sem->sem_lock);
+	spinlock_setname(&sem->sem_lock, "sem_lock");
         sem->sem_count = initial_count;
 
         return sem;
@@ -82,7 +99,7 @@ sem_destroy(struct semaphore *sem)
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(&sem_cache, sem);
 }
 
 void
@@ -143,14 +160,14 @@ lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(*lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
 
@@ -166,11 +183,17 @@ lock_create(const char *name)
         if (lock->lk_wchan == NULL){
 #endif
                 kfree(lock->lk_name);
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
         lock->lk_owner = NULL;
+        lock->lk_acquires = 0;
+        lock->lk_contended = 0;
+        lock->lk_spun = 0;
+        lock->lk_slept = 0;
+        lock->lk_handoffs = 0;
         spinlock_init(&lock->lk_lock);
+        spinlock_setname(&lock->lk_lock, "lk_lock");
 #endif
         return lock;
 }
@@ -190,58 +213,118 @@ lock_destroy(struct lock *lock)
 #endif
 #endif
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(&lock_cache, lock);
+}
+
+#if OPT_SYNCH && !USE_SEMAPHORE_FOR_LOCK
+/*
+ * Adaptive spinning. LOCK_SPIN_BURST is how many times the owner field
+ * is polled without the spinlock before checking again (under it) that
+ * the owner is still running; LOCK_SPIN_MAX bounds the total polls of
+ * one acquire, after which we sleep anyway.
+ */
+#define LOCK_SPIN_BURST 64
+#define LOCK_SPIN_MAX   4096
+
+/*
+ * True if OWNER is running on some other cpu. Must be called holding
+ * lk_lock with OWNER the lock owner: it cannot release the lock, and
+ * so cannot exit, until we let go of lk_lock.
+ */
+static
+bool
+lock_owner_running(struct thread *owner)
+{
+        return owner->t_state == S_RUN && owner->t_cpu != curcpu->c_self;
 }
+#endif
 
 void
 lock_acquire(struct lock *lock)
 {
-	/* Call this (atomically) before waiting for a lock */
-	//HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
-
         // Write this
 #if OPT_SYNCH
         KASSERT(lock != NULL);
         KASSERT(!(lock_do_i_hold(lock)));
         KASSERT(curthread->t_in_interrupt == false);
+
+	/* Call this (atomically) before waiting for a lock */
+	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
         
 #if USE_SEMAPHORE_FOR_LOCK
         P(lock->lk_sem);
         spinlock_acquire(&lock->lk_lock);
+        KASSERT(lock->lk_owner == NULL);
+        lock->lk_owner = curthread;
 #else
-        spinlock_acquire(&lock->lk_lock);        
-	while (lock->lk_owner != NULL) {
-	  wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+        struct thread *owner;
+        unsigned spins = 0, i;
+        bool slept = false;
+
+        spinlock_acquire(&lock->lk_lock);
+        lock->lk_acquires++;
+        if (lock->lk_owner != NULL) {
+                lock->lk_contended++;
+        }
+        /* lock_release may hand the lock to us while we sleep */
+        while ((owner = lock->lk_owner) != NULL && owner != curthread) {
+                if (spins < LOCK_SPIN_MAX && lock_owner_running(owner)) {
+                        /* Poll without the spinlock, so the owner can release. */
+                        spinlock_release(&lock->lk_lock);
+                        for (i = 0; i < LOCK_SPIN_BURST && lock->lk_owner == owner; i++) {
+                                /* spin */
+                        }
+                        /* Nothing read past here may come from before the poll. */
+                        membar_load_load();
+                        spins += i;
+                        spinlock_acquire(&lock->lk_lock);
+                        continue;
+                }
+                lock->lk_slept++;
+                slept = true;
+                wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+        }
+        if (spins > 0 && !slept) {
+                lock->lk_spun++;
+        }
+        if (owner == NULL) {
+                lock->lk_owner = curthread;
         }
 #endif
-        KASSERT(lock->lk_owner == NULL);
-        lock->lk_owner = curthread;
         spinlock_release(&lock->lk_lock);
 #endif
 
         (void)lock;  // suppress warning until code gets written
 
 	/* Call this (atomically) once the lock is acquired */
-	//HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
 }
 
 void
 lock_release(struct lock *lock)
 {
-	/* Call this (atomically) when the lock is released */
-	//HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
-
         // Write this
 #if OPT_SYNCH
         KASSERT(lock != NULL);
         KASSERT(lock_do_i_hold(lock));
+
+	/* Call this (atomically) when the lock is released */
+	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
+
         spinlock_acquire(&lock->lk_lock);
-        lock->lk_owner = NULL;
         
 #if USE_SEMAPHORE_FOR_LOCK
+        lock->lk_owner = NULL;
         V(lock->lk_sem);
 #else
-        wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+        /*
+         * Hand the lock to the sleeper we wake, if any; it cannot
+         * look at lk_owner before we let go of lk_lock.
+         */
+        lock->lk_owner = wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+        if (lock->lk_owner != NULL) {
+                lock->lk_handoffs++;
+        }
 #endif
         spinlock_release(&lock->lk_lock);
 #endif
@@ -266,6 +349,28 @@ lock_do_i_hold(struct lock *lock)
         return true; // dummy until code gets written
 }
 
+void
+lock_printstats(struct lock *lock)
+{
+#if OPT_SYNCH
+        unsigned acquires, contended, spun, slept, handoffs;
+
+        spinlock_acquire(&lock->lk_lock);
+        acquires = lock->lk_acquires;
+        contended = lock->lk_contended;
+        spun = lock->lk_spun;
+        slept = lock->lk_slept;
+        handoffs = lock->lk_handoffs;
+        spinlock_release(&lock->lk_lock);
+
+        kprintf("%s: %u acquires, %u contended (%u spun, %u sleeps), "
+                "%u handoffs\n",
+                lock->lk_name, acquires, contended, spun, slept, handoffs);
+#else
+        (void)lock;
+#endif
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -276,14 +381,14 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(*cv));
+        cv = kmem_cache_alloc(&cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                kmem_cache_free(&cv_cache, cv);
                 return NULL;
         }
 
@@ -291,10 +396,12 @@ cv_create(const char *name)
         cv->cv_wchan = wchan_create(cv->cv_name);
         if (cv->cv_wchan == NULL){
                 kfree(cv->cv_name);
-                kfree(cv);
+                kmem_cache_free(&cv_cache, cv);
                 return NULL;
         }
+        cv->cv_lk = NULL;
         spinlock_init(&cv->cv_lock);
+        spinlock_setname(&cv->cv_lock, "cv_lock");
 #endif
 
         return cv;
@@ -310,7 +417,7 @@ cv_destroy(struct cv *cv)
         wchan_destroy(cv->cv_wchan);
 #endif
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(&cv_cache, cv);
 }
 
 void
@@ -322,10 +429,21 @@ cv_wait(struct cv *cv, struct lock *lock)
         KASSERT(lock_do_i_hold(lock));
 
         spinlock_acquire(&cv->cv_lock);
+        KASSERT(cv->cv_lk == lock ||
+                wchan_isempty(cv->cv_wchan, &cv->cv_lock));
+        cv->cv_lk = lock;
         lock_release(lock);   
 	wchan_sleep(cv->cv_wchan, &cv->cv_lock);
         spinlock_release(&cv->cv_lock);
-        lock_acquire(lock);
+
+        if (lock_do_i_hold(lock)) {
+                /* Moved to the lock by cv_signal, and handed it. */
+                HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+                HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+        }
+        else {
+                lock_acquire(lock);
+        }
 #endif   
         // Write this
         (void)cv;    // suppress warning until code gets written
@@ -341,7 +459,17 @@ cv_signal(struct cv *cv, struct lock *lock)
         KASSERT(lock_do_i_hold(lock));
 
         spinlock_acquire(&cv->cv_lock);
+#if USE_SEMAPHORE_FOR_LOCK
 	wchan_wakeone(cv->cv_wchan, &cv->cv_lock);
+#else
+        /* We hold the lock: move a waiter to it rather than wake it. */
+        KASSERT(cv->cv_lk == lock ||
+                wchan_isempty(cv->cv_wchan, &cv->cv_lock));
+        spinlock_acquire(&lock->lk_lock);
+        wchan_moveone(cv->cv_wchan, &cv->cv_lock,
+                      lock->lk_wchan, &lock->lk_lock);
+        spinlock_release(&lock->lk_lock);
+#endif
         spinlock_release(&cv->cv_lock);
 #endif 
         // Write this
@@ -358,10 +486,189 @@ cv_broadcast(struct cv *cv, struct lock *lock)
         KASSERT(lock_do_i_hold(lock));
 
         spinlock_acquire(&cv->cv_lock);
+#if USE_SEMAPHORE_FOR_LOCK
 	wchan_wakeall(cv->cv_wchan, &cv->cv_lock);
+#else
+        /* As in cv_signal; lock_release wakes them one by one. */
+        KASSERT(cv->cv_lk == lock ||
+                wchan_isempty(cv->cv_wchan, &cv->cv_lock));
+        spinlock_acquire(&lock->lk_lock);
+        wchan_moveall(cv->cv_wchan, &cv->cv_lock,
+                      lock->lk_wchan, &lock->lk_lock);
+        spinlock_release(&lock->lk_lock);
+#endif
         spinlock_release(&cv->cv_lock);
 #endif
 	// Write this
 	(void)cv;    // suppress warning until code gets written
 	(void)lock;  // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmem_cache_alloc(&rwlock_cache);
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kmem_cache_free(&rwlock_cache, rw);
+		return NULL;
+	}
+
+#if OPT_SYNCH
+	rw->rw_rwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_rwchan == NULL) {
+		kfree(rw->rwlock_name);
+		kmem_cache_free(&rwlock_cache, rw);
+		return NULL;
+	}
+	rw->rw_wwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		kfree(rw->rwlock_name);
+		kmem_cache_free(&rwlock_cache, rw);
+		return NULL;
+	}
+	spinlock_init(&rw->rw_lock);
+	spinlock_setname(&rw->rw_lock, "rw_lock");
+	rw->rw_readers = 0;
+	rw->rw_writer = NULL;
+	rw->rw_rwaiting = 0;
+	rw->rw_wwaiting = 0;
+	rw->rw_rgrant = 0;
+#endif
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+#if OPT_SYNCH
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_rwchan);
+	wchan_destroy(rw->rw_wwchan);
+#endif
+	kfree(rw->rwlock_name);
+	kmem_cache_free(&rwlock_cache, rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+#if OPT_SYNCH
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	if (rw->rw_writer == NULL && rw->rw_wwaiting == 0) {
+		/* Fast path: no writer holding or waiting. */
+		rw->rw_readers++;
+		spinlock_release(&rw->rw_lock);
+		return;
+	}
+
+	/*
+	 * Wait to be let in by rwlock_release_write, which counts us
+	 * in rw_readers and adds a grant for us before waking us up.
+	 * Which sleeping reader takes which grant does not matter.
+	 */
+	rw->rw_rwaiting++;
+	do {
+		wchan_sleep(rw->rw_rwchan, &rw->rw_lock);
+	} while (rw->rw_rgrant == 0);
+	rw->rw_rgrant--;
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_release(&rw->rw_lock);
+#endif
+	(void)rw;
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+#if OPT_SYNCH
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_wwaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+#endif
+	(void)rw;
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+#if OPT_SYNCH
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		rw->rw_wwaiting++;
+		wchan_sleep(rw->rw_wwchan, &rw->rw_lock);
+		rw->rw_wwaiting--;
+	}
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+#endif
+	(void)rw;
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+#if OPT_SYNCH
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	if (rw->rw_rwaiting > 0) {
+		/* Readers that queued up behind us go first. */
+		rw->rw_readers += rw->rw_rwaiting;
+		rw->rw_rgrant += rw->rw_rwaiting;
+		rw->rw_rwaiting = 0;
+		wchan_wakeall(rw->rw_rwchan, &rw->rw_lock);
+	}
+	else if (rw->rw_wwaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+#endif
+	(void)rw;
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+#if OPT_SYNCH
+	bool res;
+
+	spinlock_acquire(&rw->rw_lock);
+	res = rw->rw_writer == curthread;
+	spinlock_release(&rw->rw_lock);
+	return res;
+#endif
+	(void)rw;
+	return true;
+}
@@ -35,6 +35,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
@@ -50,6 +52,8 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmem_cache.h>
+#include "opt-tickless.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -61,6 +65,22 @@ struct wchan {
 	struct threadlist wc_threads;	/* list of waiting threads */
 };
 
+/*
+ * Wait channels come from an object cache whose constructor sets up
+ * the (empty) thread list; wchan_destroy requires it to be empty again.
+ */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+}
+
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan), wchan_ctor);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
@@ -141,6 +161,11 @@ thread_create(const char *name)
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+	thread->t_sched_level = 0;
+	thread->t_sched_ticks = 0;
+	thread->t_nice = 0;
+	thread->t_ran_at = 0;
+	thread->t_affinity = 0xffffffff;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -165,6 +190,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -177,16 +203,23 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_migrating);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runqueue_mask = 0;
+	c->c_runqueue_count = 0;
+	spinlock_init_ticket(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "c_runqueue_lock");
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
+	spinlock_setname(&c->c_ipi_lock, "c_ipi_lock");
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -314,6 +347,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *tl;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -328,9 +364,14 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		tl = &curcpu->c_runqueue[i];
+		tl->tl_count = 0;
+		tl->tl_head.tln_next = &tl->tl_tail;
+		tl->tl_tail.tln_prev = &tl->tl_head;
+	}
+	curcpu->c_runqueue_mask = 0;
+	curcpu->c_runqueue_count = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -442,6 +483,233 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Static priority. The nice value bounds the levels a thread's dynamic
+ * priority can move between: a positive one keeps it out of the top
+ * levels, a negative one out of the bottom ones. At PRIO_MAX a thread
+ * always stays at the bottom level, at PRIO_MIN always at the top.
+ */
+static
+unsigned
+sched_minlevel(int nice)
+{
+	if (nice <= 0) {
+		return 0;
+	}
+	return (nice * (SCHED_NLEVELS - 1) + PRIO_MAX - 1) / PRIO_MAX;
+}
+
+static
+unsigned
+sched_maxlevel(int nice)
+{
+	if (nice >= 0) {
+		return SCHED_NLEVELS - 1;
+	}
+	return (SCHED_NLEVELS - 1) -
+		(-nice * (SCHED_NLEVELS - 1) - PRIO_MIN - 1) / -PRIO_MIN;
+}
+
+/*
+ * True if thread A should run (or be woken) before thread B: the
+ * dynamic level first, then the nice value.
+ */
+static
+bool
+sched_outranks(const struct thread *a, const struct thread *b)
+{
+	if (a->t_sched_level != b->t_sched_level) {
+		return a->t_sched_level < b->t_sched_level;
+	}
+	return a->t_nice < b->t_nice;
+}
+
+/*
+ * Run queue operations. The caller must hold the cpu's run queue lock.
+ *
+ * Threads are queued on the level they are at; they are taken from
+ * the highest priority nonempty level first, and given away (by
+ * migration) from the lowest priority one.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_sched_level < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_sched_level], t);
+	c->c_runqueue_mask |= 1U << t->t_sched_level;
+	c->c_runqueue_count++;
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (c->c_runqueue_mask & (1U << i)) {
+			t = threadlist_remhead(&c->c_runqueue[i]);
+			if (threadlist_isempty(&c->c_runqueue[i])) {
+				c->c_runqueue_mask &= ~(1U << i);
+			}
+			c->c_runqueue_count--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		if (c->c_runqueue_mask & (1U << i)) {
+			t = threadlist_remtail(&c->c_runqueue[i]);
+			if (threadlist_isempty(&c->c_runqueue[i])) {
+				c->c_runqueue_mask &= ~(1U << i);
+			}
+			c->c_runqueue_count--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Remove T, which must be on one of C's run queues.
+ */
+static
+void
+runqueue_remove(struct cpu *c, struct thread *t)
+{
+	threadlist_remove(&c->c_runqueue[t->t_sched_level], t);
+	if (threadlist_isempty(&c->c_runqueue[t->t_sched_level])) {
+		c->c_runqueue_mask &= ~(1U << t->t_sched_level);
+	}
+	c->c_runqueue_count--;
+}
+
+/*
+ * Affinity. Bit N of t_affinity is set if the thread may run on cpu
+ * N. A thread's t_cpu is always one it may run on while it is queued
+ * or asleep; only the running thread can change its mask (see
+ * thread_setaffinity).
+ */
+#define THREAD_ALLOWED(t, c) (((t)->t_affinity & (1U << (c)->c_number)) != 0)
+
+/*
+ * Find the thread nearest the tail of C's lowest priority levels that
+ * may run on DEST, skipping one that is still curthread there (see the
+ * comment in thread_consider_migration). The caller must hold C's run
+ * queue lock.
+ */
+static
+struct thread *
+runqueue_findtail(struct cpu *c, struct cpu *dest)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		if ((c->c_runqueue_mask & (1U << i)) == 0) {
+			continue;
+		}
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			if (t != c->c_curthread && THREAD_ALLOWED(t, dest)) {
+				return t;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Choose a cpu out of MASK for a thread to go to: the one with the
+ * fewest ready threads, going by the counters without locking.
+ */
+static
+struct cpu *
+thread_pickcpu(uint32_t mask)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus;
+
+	best = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if ((mask & (1U << c->c_number)) == 0) {
+			continue;
+		}
+		if (best == NULL || c->c_runqueue_count < best->c_runqueue_count) {
+			best = c;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
+static bool thread_steal(void);
+
+/*
+ * Idle until something happens.
+ *
+ * With tickless idle, if no cpu has threads waiting there is nothing
+ * to steal and nothing to reschedule, so the hardclock is stopped
+ * while idling. Whoever makes a thread runnable for this cpu, or
+ * for a busy one, wakes it with an IPI (see thread_make_runnable).
+ * If something is waiting somewhere, keep ticking so as to retry
+ * stealing it once it is no longer cache-hot.
+ */
+static
+void
+thread_idle(void)
+{
+#if OPT_TICKLESS
+	unsigned i, numcpus, waiting = 0;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		waiting += cpuarray_get(&allcpus, i)->c_runqueue_count;
+	}
+	if (waiting == 0) {
+		mainbus_hardclock_stop();
+		cpu_idle();
+		mainbus_hardclock_start();
+		return;
+	}
+#endif
+	cpu_idle();
+}
+
+/*
+ * Wake up one idle cpu other than BUSY and ourselves, if there is
+ * one. c_isidle is only looked at as a hint: an idle cpu that finds
+ * nothing to steal just goes back to sleep.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -465,8 +733,9 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	/* Target thread is now ready to run; put it on the run queue. */
+	KASSERT(THREAD_ALLOWED(target, targetcpu));
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -475,12 +744,43 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (!targetcpu->c_isidle && target != curthread) {
+		/*
+		 * Its processor is busy; if some other one is idle,
+		 * get it to come and steal work now rather than at
+		 * its next timer interrupt.
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
+/*
+ * Make runnable, elsewhere, the threads thread_switch found no longer
+ * allowed on this cpu. This is safe here because we are on the stack
+ * of a different thread.
+ *
+ * The list is per-cpu, like the list of zombies.
+ */
+static
+void
+thread_migrate_out(void)
+{
+	struct thread *t;
+
+	while ((t = threadlist_remhead(&curcpu->c_migrating)) != NULL) {
+		KASSERT(t != curthread);
+		KASSERT(t->t_state == S_READY);
+		t->t_cpu = thread_pickcpu(t->t_affinity);
+		DEBUG(DB_THREADS, "Moved thread %s: cpu %u -> %u",
+		      t->t_name, curcpu->c_number, t->t_cpu->c_number);
+		thread_make_runnable(t, false);
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -489,7 +789,8 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  *
  * The new thread is created in the process P. If P is null, the
  * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * as the caller, unless the scheduler intervenes first, or the caller's
+ * affinity (which the new thread inherits) excludes that CPU.
  */
 int
 thread_fork(const char *name,
@@ -518,7 +819,16 @@ thread_fork(const char *name,
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = curthread->t_affinity;
+	if (THREAD_ALLOWED(newthread, curthread->t_cpu)) {
+		newthread->t_cpu = curthread->t_cpu;
+	}
+	else {
+		/* only while thread_setaffinity is moving us */
+		newthread->t_cpu = thread_pickcpu(newthread->t_affinity);
+	}
+	newthread->t_nice = curthread->t_nice;
+	newthread->t_sched_level = sched_minlevel(newthread->t_nice);
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -584,11 +894,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* For cache affinity: when this thread last had the cpu. */
+	cur->t_ran_at = curcpu->c_hardclocks;
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runqueue_mask == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -599,7 +912,17 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		if (THREAD_ALLOWED(cur, curcpu)) {
+			thread_make_runnable(cur, true /*have lock*/);
+			break;
+		}
+		/*
+		 * No longer allowed here (see thread_setaffinity). We
+		 * are still running on its stack, so it must not be
+		 * visible to other cpus until we have switched away;
+		 * thread_migrate_out sends it on from the next thread.
+		 */
+		threadlist_addtail(&curcpu->c_migrating, cur);
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -622,7 +945,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and if that fails call cpu_idle().
 	 * curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -641,10 +965,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				thread_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -723,6 +1049,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Send on threads that may no longer run here. */
+	thread_migrate_out();
+
 	/* Turn interrupts back on. */
 	splx(spl);
 }
@@ -756,6 +1085,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Send on threads that may no longer run here. */
+	thread_migrate_out();
+
 	/* Enable interrupts. */
 	spl0();
 
@@ -816,17 +1148,216 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Threads start at level 0
+ * with a quantum of one hardclock; each time a thread uses up its
+ * whole quantum it drops one level, and the quantum doubles with each
+ * level. A thread that sleeps and is woken up goes back up one level,
+ * so threads that mostly wait for I/O (the console, the shell) stay
+ * above CPU-bound ones. Threads at the same level run round-robin.
  */
+#define SCHED_QUANTUM(level)	(1U << (level))
 
-void
-schedule(void)
+/*
+ * The quantum also adapts to the length of the run queue. With at most
+ * one thread waiting it is doubled, to switch less often; with more,
+ * it is cut so that everybody waiting gets the cpu within about
+ * SCHED_LATENCY hardclocks.
+ */
+#define SCHED_LATENCY		16
+
+static
+unsigned
+thread_quantum(unsigned level, unsigned waiting)
 {
+	unsigned quantum = SCHED_QUANTUM(level);
+
+	if (waiting <= 1) {
+		return quantum * 2;
+	}
+	if (quantum > SCHED_LATENCY / waiting) {
+		quantum = SCHED_LATENCY / waiting;
+	}
+	return quantum > 0 ? quantum : 1;
+}
+
+/*
+ * Charge the current thread for the hardclock that just happened,
+ * and tell the caller whether to preempt it.
+ */
+bool
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+
+	/* The idle loop runs on the stack of a sleeping thread. */
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	cur->t_sched_ticks++;
+	if (cur->t_sched_ticks >= thread_quantum(cur->t_sched_level,
+						 curcpu->c_runqueue_count)) {
+		cur->t_sched_ticks = 0;
+		if (cur->t_sched_level < sched_maxlevel(cur->t_nice)) {
+			cur->t_sched_level++;
+		}
+		return true;
+	}
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Quantum not over yet: preempt only for a higher priority
+	 * thread. The mask is read without the lock; at worst we
+	 * find out at the next hardclock.
 	 */
+	return (curcpu->c_runqueue_mask &
+		((1U << cur->t_sched_level) - 1)) != 0;
+}
+
+/*
+ * Wake-up boost: a thread that slept goes one level up and starts a
+ * fresh quantum. The caller has just taken it off a wait channel, so
+ * nobody else can be looking at it.
+ */
+static
+void
+thread_wakeup(struct thread *target)
+{
+	if (target->t_sched_level > sched_minlevel(target->t_nice)) {
+		target->t_sched_level--;
+	}
+	target->t_sched_ticks = 0;
+	thread_make_runnable(target, false);
+}
+
+/*
+ * This is called periodically from hardclock(). To keep CPU-bound
+ * threads at the bottom level from starving behind a steady stream of
+ * interactive ones, it moves every thread of this cpu back to the top
+ * level its nice value allows.
+ */
+void
+schedule(void)
+{
+	struct threadlist boosted;
+	struct thread *t;
+	unsigned i;
+
+	/* Nobody waiting: nobody to starve. */
+	if (curcpu->c_runqueue_count == 0) {
+		return;
+	}
+
+	threadlist_init(&boosted);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			threadlist_addtail(&boosted, t);
+		}
+	}
+	curcpu->c_runqueue_mask &= 1;
+	curcpu->c_runqueue_count = curcpu->c_runqueue[0].tl_count;
+	while ((t = threadlist_remhead(&boosted)) != NULL) {
+		t->t_sched_level = sched_minlevel(t->t_nice);
+		t->t_sched_ticks = 0;
+		runqueue_add(curcpu->c_self, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&boosted);
+
+	if (!curcpu->c_isidle) {
+		curthread->t_sched_level = sched_minlevel(curthread->t_nice);
+		curthread->t_sched_ticks = 0;
+	}
+}
+
+/*
+ * Static priority of the current thread. Changing it moves the
+ * thread's dynamic level inside the new bounds right away; threads
+ * forked afterwards inherit it.
+ */
+int
+thread_getnice(void)
+{
+	return curthread->t_nice;
+}
+
+void
+thread_setnice(int nice)
+{
+	struct thread *cur = curthread;
+
+	if (nice < PRIO_MIN) {
+		nice = PRIO_MIN;
+	}
+	if (nice > PRIO_MAX) {
+		nice = PRIO_MAX;
+	}
+	cur->t_nice = nice;
+	if (cur->t_sched_level < sched_minlevel(nice)) {
+		cur->t_sched_level = sched_minlevel(nice);
+	}
+	if (cur->t_sched_level > sched_maxlevel(nice)) {
+		cur->t_sched_level = sched_maxlevel(nice);
+	}
+}
+
+/*
+ * Entry point of the thread forked by thread_setaffinity; it has
+ * nothing to do.
+ */
+static
+void
+thread_bounce(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+}
+
+/*
+ * Change the affinity of the current thread.
+ *
+ * If this cpu is no longer allowed we have to go. thread_switch puts
+ * us on c_migrating and the next thread to run here sends us on, but
+ * that needs a next thread: if this cpu idled instead, it would do so
+ * on our stack, and we could not run anywhere else until it stopped.
+ * So fork one that returns at once, pinned here so that nobody steals
+ * it before we switch to it.
+ */
+int
+thread_setaffinity(uint32_t mask)
+{
+	struct thread *cur = curthread;
+	unsigned numcpus;
+	uint32_t oldmask;
+	int result;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 32) {
+		mask &= (1U << numcpus) - 1;
+	}
+	if (mask == 0) {
+		return EINVAL;
+	}
+
+	while ((mask & (1U << curcpu->c_number)) == 0) {
+		oldmask = cur->t_affinity;
+		cur->t_affinity = 1U << curcpu->c_number;
+		result = thread_fork("bounce", kproc, thread_bounce, NULL, 0);
+		if (result) {
+			cur->t_affinity = oldmask;
+			return result;
+		}
+		cur->t_affinity = mask;
+		/*
+		 * If the bounce thread already ran (we may have been
+		 * preempted) and nothing else is ready, thread_yield
+		 * returns at once and we go around again.
+		 */
+		thread_yield();
+	}
+	cur->t_affinity = mask;
+	return 0;
 }
 
 /*
@@ -855,16 +1386,19 @@ thread_consider_migration(void)
 	struct threadlist victims;
 	struct thread *t;
 
+	/*
+	 * The counts are read without the run queue locks; they are
+	 * only used to decide how many threads to offer, and the loop
+	 * below rechecks under the lock.
+	 */
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += c->c_runqueue_count;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_runqueue_count;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -876,9 +1410,13 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remtail(curcpu->c_self);
+		if (t == NULL) {
+			break;
+		}
 		threadlist_addhead(&victims, t);
 	}
+	to_send = i;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
@@ -887,7 +1425,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (c->c_runqueue_count < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -911,14 +1449,15 @@ thread_consider_migration(void)
 			 * skip it. Then it goes back on our own run
 			 * queue below.
 			 */
-			if (t == curthread) {
+			if (t == curthread || !THREAD_ALLOWED(t, c)) {
+				/* the same goes for threads pinned away from c */
 				threadlist_addtail(&victims, t);
 				to_send--;
 				continue;
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -942,7 +1481,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -951,6 +1490,82 @@ thread_consider_migration(void)
 	threadlist_cleanup(&victims);
 }
 
+/*
+ * Work stealing.
+ *
+ * Migration above only pushes threads every MIGRATE_HARDCLOCKS. In
+ * between, a cpu that runs out of threads calls this before going
+ * idle: it picks the cpu with the most ready threads, going by the
+ * counters without taking any other cpu's lock, and takes one thread
+ * from the tail of its lowest priority level that may run here.
+ *
+ * A thread that was switched out on its cpu very recently probably
+ * still has its working set in that cpu's cache, so it is only taken
+ * if others are waiting behind it; otherwise it is left where it is
+ * and will run there soon.
+ *
+ * Returns true if a thread was put on our run queue.
+ */
+#define STEAL_HOT_HARDCLOCKS	2	/* Cache-hot if switched out this recently */
+#define STEAL_HOT_MINLOAD	2	/* Ready threads needed to steal a hot one */
+
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, load, maxload;
+
+	victim = NULL;
+	maxload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			/* an idle cpu with ready threads is about to run them */
+			continue;
+		}
+		load = c->c_runqueue_count;
+		if (load > maxload) {
+			maxload = load;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	/*
+	 * Only one run queue lock is held at a time, so stealers
+	 * cannot deadlock with each other or with migration.
+	 */
+	spinlock_acquire(&victim->c_runqueue_lock);
+	/*
+	 * runqueue_findtail skips a thread that is still curthread
+	 * there and threads not allowed on this cpu. Nor do we take a
+	 * cache-hot one with nobody else waiting.
+	 */
+	t = runqueue_findtail(victim, curcpu->c_self);
+	if (t == NULL ||
+	    (victim->c_hardclocks - t->t_ran_at < STEAL_HOT_HARDCLOCKS &&
+	     victim->c_runqueue_count < STEAL_HOT_MINLOAD)) {
+		spinlock_release(&victim->c_runqueue_lock);
+		return false;
+	}
+	runqueue_remove(victim, t);
+	t->t_cpu = curcpu->c_self;
+	spinlock_release(&victim->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_add(curcpu->c_self, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return true;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -970,11 +1585,11 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
+	/* wc_threads is set up by the cache constructor */
 	wc->wc_name = name;
 
 	return wc;
@@ -987,8 +1602,9 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
+	/* Only checks; the empty list is the constructed state we give back */
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(&wchan_cache, wc);
 }
 
 /*
@@ -1015,21 +1631,44 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 }
 
 /*
- * Wake up one thread sleeping on a wait channel.
+ * Take the next thread to wake off a wait channel: the highest
+ * priority one; among equals, the one that has been sleeping longest.
+ * Returns NULL if nobody is sleeping.
  */
-void
+static
+struct thread *
+wchan_pick(struct wchan *wc)
+{
+	struct thread *target, *t;
+
+	target = NULL;
+	THREADLIST_FORALL(t, wc->wc_threads) {
+		if (target == NULL || sched_outranks(t, target)) {
+			target = t;
+		}
+	}
+
+	if (target != NULL) {
+		threadlist_remove(&wc->wc_threads, target);
+	}
+	return target;
+}
+
+/*
+ * Wake up one thread sleeping on a wait channel. Returns the thread
+ * woken, or NULL if there was none.
+ */
+struct thread *
 wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
-	/* Grab a thread from the channel */
-	target = threadlist_remhead(&wc->wc_threads);
-
+	target = wchan_pick(wc);
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
 
 	/*
@@ -1040,7 +1679,8 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
-	thread_make_runnable(target, false);
+	thread_wakeup(target);
+	return target;
 }
 
 /*
@@ -1070,12 +1710,48 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		thread_wakeup(target);
 	}
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move the thread wchan_wakeone would wake, or all threads, from
+ * channel FROM to channel TO without waking them; they stay asleep
+ * and are woken from TO later. Both spinlocks must be held.
+ */
+void
+wchan_moveone(struct wchan *from, struct spinlock *fromlk,
+	      struct wchan *to, struct spinlock *tolk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	target = wchan_pick(from);
+	if (target != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+}
+
+void
+wchan_moveall(struct wchan *from, struct spinlock *fromlk,
+	      struct wchan *to, struct spinlock *tolk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1162,6 +1838,26 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to all CPUs but this one.
+ */
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -90,6 +90,16 @@ DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Protects knowndevs and the kd_fs fields. Lookups of device names
+ * only read, so they take it shared and run in parallel; adding
+ * devices, mount/unmount and swapon/swapoff take it exclusive.
+ *
+ * Lock order: knowndevs_lock before vfs_biglock, since the FSOP_*
+ * calls made under knowndevs_lock take the big lock themselves.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -106,6 +116,11 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
@@ -175,6 +190,7 @@ vfs_sync(void)
 	struct knowndev *dev;
 	unsigned i, num;
 
+	rwlock_acquire_read(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
@@ -186,6 +202,7 @@ vfs_sync(void)
 	}
 
 	vfs_biglock_release();
+	rwlock_release_read(knowndevs_lock);
 
 	return 0;
 }
@@ -194,14 +211,13 @@ vfs_sync(void)
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
  */
+static
 int
-vfs_getroot(const char *devname, struct vnode **ret)
+getroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -270,6 +286,17 @@ vfs_getroot(const char *devname, struct vnode **ret)
 	return ENODEV;
 }
 
+int
+vfs_getroot(const char *devname, struct vnode **ret)
+{
+	int result;
+
+	rwlock_acquire_read(knowndevs_lock);
+	result = getroot(devname, ret);
+	rwlock_release_read(knowndevs_lock);
+	return result;
+}
+
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
  */
@@ -281,8 +308,7 @@ vfs_getdevname(struct fs *fs)
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
-
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -294,9 +320,11 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
+			rwlock_release_read(knowndevs_lock);
 			return kd->kd_name;
 		}
 	}
+	rwlock_release_read(knowndevs_lock);
 
 	return NULL;
 }
@@ -358,7 +386,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -401,7 +429,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	/* Silence warning with gcc 4.8 -Og (but not -O2) */
 	index = 0;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	name = kstrdup(dname);
 	if (name==NULL) {
@@ -453,7 +481,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 
  fail:
@@ -470,7 +498,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -509,7 +537,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -543,16 +571,19 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
 	if (result) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
@@ -561,6 +592,7 @@ vfs_mount(const char *devname, void *data,
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
@@ -574,6 +606,7 @@ vfs_mount(const char *devname, void *data,
 		volname ? volname : kd->kd_name, kd->kd_name);
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 }
 
@@ -601,7 +634,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 		devname = myname;
 	}
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -622,7 +655,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 	*ret = kd->kd_vnode;
 
  out:
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	if (myname != NULL) {
 		kfree(myname);
 	}
@@ -640,6 +673,7 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -674,6 +708,7 @@ vfs_unmount(const char *devname)
 
  fail:
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -690,7 +725,7 @@ vfs_swapoff(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -710,7 +745,7 @@ vfs_swapoff(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -724,6 +759,7 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
@@ -781,6 +817,7 @@ vfs_unmountall(void)
 	}
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 
 	return 0;
 }
@@ -33,18 +33,24 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <kmem_cache.h>
 
 #if OPT_PAGING
 
 #include <synch.h>
+#include <wchan.h>
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include <elf.h>
 #include <vm_tlb.h>
 #include <my_vm.h>
+#include <coremap.h>
 
 #endif
 
+static struct kmem_cache addrspace_cache =
+	KMEM_CACHE_INITIALIZER("addrspace", sizeof(struct addrspace), NULL);
+
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -57,32 +63,49 @@ as_create(char *progname)
 	struct addrspace *as;
 	vm_can_sleep();
 
-	as = kmalloc(sizeof(struct addrspace));
+	as = kmem_cache_alloc(&addrspace_cache);
 	if (as == NULL) {
 		return NULL;
 	}
 
 #if OPT_PAGING
 	as->progname = kstrdup(progname);
-	if (as->progname == NULL)
+	if (as->progname == NULL) {
+		kmem_cache_free(&addrspace_cache, as);
 		return NULL;
+	}
 
 	if (vfs_open(progname, O_RDONLY, 0, &(as->v))) {
 		kprintf("Unable to open the file %s", progname);
 		kfree(as->progname);
+		kmem_cache_free(&addrspace_cache, as);
 		return NULL;
 	}
 	
 	as->pt = NULL;
 	as->pt_num_pages = 0;
 	as->segments = NULL;
+	as->num_pinned = 0;
 
-	as->pt_lock = lock_create("pt_lock");
+	as->pt_lock = rwlock_create("pt_lock");
 	if (as->pt_lock == NULL) {
 		kprintf("Unable to create page table lock");
-		kfree(as);
 		kfree(as->progname);
 		vfs_close(as->v);
+		kmem_cache_free(&addrspace_cache, as);
+		return NULL;
+	}
+
+	spinlock_init(&as->pt_transit_lock);
+	spinlock_setname(&as->pt_transit_lock, "pt_transit_lock");
+	as->pt_transit_wchan = wchan_create("pt_transit");
+	if (as->pt_transit_wchan == NULL) {
+		kprintf("Unable to create page table wait channel");
+		spinlock_cleanup(&as->pt_transit_lock);
+		rwlock_destroy(as->pt_lock);
+		kfree(as->progname);
+		vfs_close(as->v);
+		kmem_cache_free(&addrspace_cache, as);
 		return NULL;
 	}
 	
@@ -129,17 +152,20 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		newas_curseg = new_seg;
 	}
 
-	lock_acquire(old->pt_lock);
+	rwlock_acquire_read(old->pt_lock);
 
 	pagetable *new_as_pt = NULL;
 	
 	int pt_copy_ret_val = pt_copy(old->pt, &new_as_pt);
-	lock_release(old->pt_lock);
+	rwlock_release_read(old->pt_lock);
 	
 	if (pt_copy_ret_val != 0)
 		return pt_copy_ret_val;
 
 	newas->pt_num_pages = old->pt_num_pages;
+
+	memcpy(newas->pinned, old->pinned, sizeof(old->pinned));
+	newas->num_pinned = old->num_pinned;
 #else
 	(void)old;
 #endif
@@ -159,15 +185,27 @@ as_destroy(struct addrspace *as)
 
 	if (as->v != NULL)
 		vfs_close(as->v);
+
+	/*
+	 * Give the frames back first, so that they can no longer be
+	 * chosen as eviction victims, then release the swap slots.
+	 */
+	freeppages_user_as(as);
 	
 	if (as->pt != NULL && as->pt_lock != NULL) {
-		lock_acquire(as->pt_lock);
+		rwlock_acquire_write(as->pt_lock);
+		pt_free_swap_slots(as->pt);
 		pt_destroy(as->pt);
-		lock_release(as->pt_lock);
+		rwlock_release_write(as->pt_lock);
+	}
+
+	if (as->pt_transit_wchan != NULL) {
+		wchan_destroy(as->pt_transit_wchan);
+		spinlock_cleanup(&as->pt_transit_lock);
 	}
 
 	if (as->pt_lock != NULL)
-		lock_destroy(as->pt_lock);
+		rwlock_destroy(as->pt_lock);
 	
 	if (as->segments != NULL) {
 		segments_destroy_linked_list(as->segments);
@@ -177,7 +215,7 @@ as_destroy(struct addrspace *as)
 		kfree(as->progname);
 #endif
 
-	kfree(as);
+	kmem_cache_free(&addrspace_cache, as);
 }
 
 void
@@ -196,6 +234,7 @@ as_activate(void)
 
 #if OPT_PAGING
 	tlb_invalidate();
+	tlb_set_wired(as->pinned, as->num_pinned);
 #endif
 
 }
@@ -278,7 +317,7 @@ as_prepare_load(struct addrspace *as)
 	}
 
 	// Define page table
-	lock_acquire(as->pt_lock);
+	rwlock_acquire_write(as->pt_lock);
 
 	segment *curseg = as->segments;
 	vaddr_t base_vaddr1 = curseg->base_vaddr;
@@ -298,9 +337,10 @@ as_prepare_load(struct addrspace *as)
 		}
 	}
 
-	as->pt = pt_init(base_vaddr1, num_pages1, base_vaddr2, numpages_2);
+	// The stack is defined after the load, but its position and size are fixed
+	as->pt = pt_init(base_vaddr1, num_pages1, base_vaddr2, numpages_2, USERSTACK - STACK_PAGES * PAGE_SIZE, STACK_PAGES);
 
-	lock_release(as->pt_lock);
+	rwlock_release_write(as->pt_lock);
 
 	if (as->pt == NULL)
 		return ENOMEM;
@@ -332,6 +372,9 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	if (as_define_region(as, USERSTACK - stack_size, stack_size, (PF_W | PF_R), 0, 0) != 0)
 		return ENOMEM;
 
+	/* The top of the stack is touched by nearly every function call */
+	as_pin_page(as, USERSTACK - PAGE_SIZE);
+
 #else
 	(void)as;
 #endif
@@ -341,6 +384,59 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Pin the page holding VADDR. Returns EFAULT if it is not in any
+ * segment, ENOSPC if all the wired slots are taken.
+ */
+int
+as_pin_page(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned int i;
+
+	KASSERT(as != NULL);
+
+	vaddr &= PAGE_FRAME;
+	if (as_find_segment(as, vaddr) == NULL) {
+		return EFAULT;
+	}
+
+	for (i = 0; i < as->num_pinned; i++) {
+		if (as->pinned[i] == vaddr) {
+			return 0;
+		}
+	}
+	if (as->num_pinned == TLB_WIRED_SLOTS) {
+		return ENOSPC;
+	}
+	as->pinned[as->num_pinned++] = vaddr;
+
+	if (as == proc_getas()) {
+		tlb_set_wired(as->pinned, as->num_pinned);
+	}
+
+	return 0;
+}
+
+void
+as_unpin_page(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned int i;
+
+	KASSERT(as != NULL);
+
+	vaddr &= PAGE_FRAME;
+	for (i = 0; i < as->num_pinned; i++) {
+		if (as->pinned[i] == vaddr) {
+			as->pinned[i] = as->pinned[--as->num_pinned];
+			break;
+		}
+	}
+
+	if (as == proc_getas()) {
+		tlb_set_wired(as->pinned, as->num_pinned);
+	}
+}
+
 segment *as_find_segment(struct addrspace *as, vaddr_t vaddr) {
 	KASSERT(as != NULL);
 	KASSERT(as->segments != NULL);
@@ -11,11 +11,18 @@
 #include <vm_tlb.h>
 #include <synch.h>
 #include <my_vm.h>
+#include <vmstats.h>
+#include <shrinker.h>
+#include <wchan.h>
+#include <thread.h>
 
 
-struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
-struct spinlock victim_lock = SPINLOCK_INITIALIZER;
+struct spinlock stealmem_lock = SPINLOCK_INITIALIZER_NAMED("stealmem_lock");
+struct spinlock coremap_lock = SPINLOCK_TICKET_INITIALIZER_NAMED("coremap_lock");
+struct spinlock victim_lock = SPINLOCK_INITIALIZER_NAMED("victim_lock");
+
+//woken (under coremap_lock) when an evicted frame has been handed over
+static struct wchan *evict_wchan = NULL;
 
 
 //memory is seen as an array of coremap_entry (each one is a frame of 4096 B)
@@ -54,6 +61,9 @@ int coremap_init(void){
         coremap[i].as = NULL;
         coremap[i].next_allocated = 0;
 		coremap[i].prev_allocated = 0;
+        coremap[i].evicting = 0;
+        coremap[i].loading = 0;
+        coremap[i].kref = NULL;
     }
 
     invalid_ref = num_ram_frames;
@@ -64,6 +74,10 @@ int coremap_init(void){
 	is_active = 1;
 	spinlock_release(&coremap_lock);
 
+    evict_wchan = wchan_create("coremap_evict");
+    if (evict_wchan == NULL)
+        panic("failed to create coremap wchan\n");
+
     return 0;
 }
 
@@ -75,6 +89,9 @@ int coremap_close(void){
     if (is_active==0)
         panic("Error, coremap not found\n");
     
+    wchan_destroy(evict_wchan);
+    evict_wchan = NULL;
+
     spinlock_acquire(&coremap_lock);
 	is_active = 0;
 	spinlock_release(&coremap_lock);
@@ -140,6 +157,7 @@ static paddr_t getfreeppages(unsigned long npages, int entry_type, struct addrsp
             else if (entry_type == KERNEL_ENTRY){
                 coremap[i].as = NULL;
                 coremap[i].vaddr = 0;
+                coremap[i].kref = NULL;
             }
         }
         coremap[found].alloc_size = npages;
@@ -174,11 +192,16 @@ static paddr_t getppages(unsigned long npages){
             coremap[start_page].alloc_size = npages;
             for (i=start_page; i<start_page+npages; i++){
                 coremap[i].type = KERNEL_ENTRY;
+                coremap[i].kref = NULL;
             }
             spinlock_release(&stealmem_lock);
         }
     }
 
+    //memory pressure: let the registered shrinkers release something, then retry once
+    if (addr == 0 && shrinker_run(npages) > 0)
+        addr = getfreeppages(npages, KERNEL_ENTRY, NULL, 0);
+
     return addr;
 }
 
@@ -205,6 +228,7 @@ static int freeppages(paddr_t addr, unsigned long npages){
         coremap[i].type = FREED_ENTRY;
         coremap[i].as = NULL;
         coremap[i].vaddr = 0;
+        coremap[i].kref = NULL;
     }
 
     spinlock_release(&coremap_lock);
@@ -246,20 +270,236 @@ void free_kpages(vaddr_t addr){
 }
 
 
+/*
+called by kfree(), number of frames of the kernel block starting at kvaddr (0 if not one)
+*/
+unsigned int coremap_get_alloc_size(vaddr_t kvaddr){
+    unsigned int index;
+
+    if (!isCoremapActive())
+        return 0;
+
+    if (kvaddr < MIPS_KSEG0 || kvaddr >= MIPS_KSEG1)
+        return 0;
+
+    index = (kvaddr - MIPS_KSEG0) / PAGE_SIZE;
+    if (index >= num_ram_frames || coremap[index].type != KERNEL_ENTRY)
+        return 0;
+
+    return coremap[index].alloc_size;
+}
+
+
+/*
+fragmentation of physical memory: number of free frames and length of the longest free run
+frames never handed out by ram_stealmem() are the untracked ones after the last tracked frame
+*/
+void coremap_fragstats(unsigned int *nfree, unsigned int *largest_run){
+    unsigned int i, run = 0, last_tracked = 0;
+
+    *nfree = 0;
+    *largest_run = 0;
+
+    if (!isCoremapActive())
+        return;
+
+    spinlock_acquire(&coremap_lock);
+
+    for (i=0; i<num_ram_frames; i++){
+        if (coremap[i].type != UNTRACKED_ENTRY)
+            last_tracked = i;
+    }
+
+    for (i=0; i<num_ram_frames; i++){
+        if (coremap[i].type == FREED_ENTRY || (coremap[i].type == UNTRACKED_ENTRY && i > last_tracked)){
+            (*nfree)++;
+            run++;
+            if (run > *largest_run)
+                *largest_run = run;
+        }
+        else
+            run = 0;
+    }
+
+    spinlock_release(&coremap_lock);
+}
+
+
+/*
+called by kmalloc(), records the subpage pageref that owns a kernel page (NULL to clear it)
+no lock needed: the page belongs to kmalloc until free_kpages()
+*/
+void coremap_set_kref(vaddr_t kvaddr, void *kref){
+    unsigned int index;
+
+    if (!isCoremapActive())
+        return;
+
+    KASSERT(kvaddr >= MIPS_KSEG0 && kvaddr < MIPS_KSEG1);
+    index = (kvaddr - MIPS_KSEG0) / PAGE_SIZE;
+    KASSERT(index < num_ram_frames);
+    KASSERT(coremap[index].type == KERNEL_ENTRY);
+
+    coremap[index].kref = kref;
+}
+
+
+/*
+called by kfree(), constant time lookup of the subpage pageref owning a kernel address
+returns 1 if the address is on a kernel page tracked by the coremap (kref is NULL for whole-page blocks),
+0 if the coremap does not know it
+*/
+int coremap_get_kref(vaddr_t kvaddr, void **kref){
+    unsigned int index;
+
+    if (!isCoremapActive())
+        return 0;
+
+    if (kvaddr < MIPS_KSEG0 || kvaddr >= MIPS_KSEG1)
+        return 0;
+
+    index = (kvaddr - MIPS_KSEG0) / PAGE_SIZE;
+    if (index >= num_ram_frames || coremap[index].type != KERNEL_ENTRY)
+        return 0;
+
+    *kref = coremap[index].kref;
+    return 1;
+}
+
+
 
 /*
 User space management functions (with swap out/in)
 */
 
+/*
+returns true if the frame contains only zeroes (word-wise scan, stops at first non-zero word)
+*/
+static int page_is_zero(paddr_t paddr){
+    const uint32_t *words = (const uint32_t *)PADDR_TO_KVADDR(paddr);
+    unsigned int i;
+
+    for (i=0; i<PAGE_SIZE/sizeof(uint32_t); i++){
+        if (words[i] != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+removes a user page from the allocation queue (coremap_lock must be held)
+new_victim and new_last_all are updated if the page was at one end of the queue
+*/
+static void unlink_allocated(unsigned int found, paddr_t *new_victim, paddr_t *new_last_all){
+    if (coremap[found].prev_allocated == invalid_ref){
+        //first element in queue
+        if (coremap[found].next_allocated == invalid_ref){
+            //only element in queue
+            *new_victim = invalid_ref;
+            *new_last_all = invalid_ref;
+        }
+        else {
+            //shift forward
+            coremap[coremap[found].next_allocated].prev_allocated = invalid_ref;
+            *new_victim = coremap[found].next_allocated;
+        }
+    }
+    else {
+        //other elements before it in queue
+        if (coremap[found].next_allocated == invalid_ref){
+            //last one --> shift backward
+            coremap[coremap[found].prev_allocated].next_allocated = invalid_ref;
+            *new_last_all = coremap[found].prev_allocated;
+        }
+        else {
+            //in the middle --> update both directions
+            coremap[coremap[found].next_allocated].prev_allocated = coremap[found].prev_allocated;
+            coremap[coremap[found].prev_allocated].next_allocated = coremap[found].next_allocated;
+        }
+    }
+    coremap[found].next_allocated = invalid_ref;
+    coremap[found].prev_allocated = invalid_ref;
+}
+
+
+/*
+adds a user page at the end of the allocation queue (coremap_lock must be held)
+*/
+static void append_allocated(unsigned int found){
+    spinlock_acquire(&victim_lock);
+    if (last_allocate != invalid_ref){
+        coremap[last_allocate].next_allocated = found;
+        coremap[found].prev_allocated = last_allocate;
+    }
+    else {
+        coremap[found].prev_allocated = invalid_ref;
+        victim = found;
+    }
+    coremap[found].next_allocated = invalid_ref;
+    last_allocate = found;
+    spinlock_release(&victim_lock);
+}
+
+
+/*
+removes a user page from the allocation queue, updating victim and last_allocate (coremap_lock must be held)
+*/
+static void remove_allocated(unsigned int found){
+    paddr_t new_last_all, new_victim;
+
+    spinlock_acquire(&victim_lock);
+    new_last_all = last_allocate;
+    new_victim = victim;
+    unlink_allocated(found, &new_victim, &new_last_all);
+    last_allocate = new_last_all;
+    victim = new_victim;
+    spinlock_release(&victim_lock);
+}
+
+
+/*
+oldest user page that can be evicted (coremap_lock must be held): not already being evicted,
+and not still being loaded, since its page table entry is in transit
+returns invalid_ref if there is none
+*/
+static paddr_t pick_victim(void){
+    paddr_t i;
+
+    spinlock_acquire(&victim_lock);
+    i = victim;
+    spinlock_release(&victim_lock);
+
+    while (i != invalid_ref && (coremap[i].evicting || coremap[i].loading))
+        i = coremap[i].next_allocated;
+
+    return i;
+}
+
+
+/*
+true if vaddr of as is still mapped on the frame at paddr (as->pt_lock must be held)
+*/
+static int victim_mapped(struct addrspace *as, vaddr_t vaddr, paddr_t paddr){
+    paddr_t mapped;
+    uint32_t perm;
+
+    return pt_get_page(as->pt, vaddr, &mapped, &perm) == PT_ENTRY_VALID && mapped == paddr;
+}
+
+
 /*
 allocates one page per time (on-demand) for user processes
+evicted is set to the page thrown out to make room for it, 0 if none
+the page cannot be evicted until the caller has mapped it and called coremap_user_loaded()
 */
-paddr_t getppage_user(vaddr_t vadd){
-    struct addrspace *as;
+paddr_t getppage_user(vaddr_t vadd, vaddr_t *evicted){
+    struct addrspace *as, *victim_as;
+    vaddr_t victim_vaddr;
     paddr_t padd;
-    paddr_t last_tmp, victim_tmp, victim_new;
+    paddr_t victim_tmp;
     off_t offset;
-    int res;
+    int res, swap_cached, zero;
 
     vm_can_sleep();
 
@@ -270,6 +510,8 @@ paddr_t getppage_user(vaddr_t vadd){
     //alignment check
     KASSERT((vadd & PAGE_FRAME) == vadd);
 
+    *evicted = 0;
+
     //first try to find a freed page
     padd = getfreeppages(1, USER_ENTRY, as, vadd);
     if (padd == 0){
@@ -281,11 +523,6 @@ paddr_t getppage_user(vaddr_t vadd){
 
     //check if it is necessary to update the coremap
     if (isCoremapActive()){
-        spinlock_acquire(&victim_lock);
-		last_tmp = last_allocate;
-		victim_tmp = victim;
-		spinlock_release(&victim_lock);
-
         if (padd != 0){
             //found free space, update associate coremap entry
             spinlock_acquire(&coremap_lock);
@@ -295,63 +532,92 @@ paddr_t getppage_user(vaddr_t vadd){
 			coremap[found].alloc_size = 1;
 			coremap[found].as = as;
 			coremap[found].vaddr = vadd;
-            if (last_tmp != invalid_ref){
-                //page already allocated
-				coremap[last_tmp].next_allocated = found;
-				coremap[found].prev_allocated = last_tmp;
-				coremap[found].next_allocated = invalid_ref;
-			}
-			else{
-				coremap[found].prev_allocated = invalid_ref;
-				coremap[found].next_allocated = invalid_ref;
-			}
-			
-            spinlock_release(&coremap_lock);
+            coremap[found].evicting = 0;
+            coremap[found].loading = 1;
+            append_allocated(found);
 
-            //update victim's info
-            spinlock_acquire(&victim_lock);
-			if (victim_tmp == invalid_ref)
-				victim = found;
-			last_allocate = found;
-			spinlock_release(&victim_lock);
+            spinlock_release(&coremap_lock);
         }
         else {
             //memory is full, we have to swap out the victim page
 
+            //the victim page may belong to another process: it is marked as evicting until it is ours,
+            //so that no other fault picks it and freeppages_user_as() (as_destroy) waits for it
+            spinlock_acquire(&coremap_lock);
+            victim_tmp = pick_victim();
+            while (victim_tmp == invalid_ref){
+                //every user page is being evicted or loaded by some other fault
+                spinlock_release(&coremap_lock);
+                thread_yield();
+                spinlock_acquire(&coremap_lock);
+                victim_tmp = pick_victim();
+            }
+            KASSERT(coremap[victim_tmp].type == USER_ENTRY);
+            KASSERT(!coremap[victim_tmp].loading);
+            coremap[victim_tmp].evicting = 1;
+            victim_as = coremap[victim_tmp].as;
+            victim_vaddr = coremap[victim_tmp].vaddr;
+            spinlock_release(&coremap_lock);
+
             //physical address of victim 
             //it will be our freed page to be returned
             padd = (paddr_t)victim_tmp * PAGE_SIZE;
 
-            //saves in offset the position in swapfile of victim
-            res = swap_out(padd, &offset);
-            if (res)
-                panic("swap out failed\n");
+            //unmap the victim before looking at its frame: from now on its faults wait in pt_wait_transit(),
+            //and once no CPU has it in its TLB or TLB cache its owner can no longer write to the frame
+            rwlock_acquire_write(victim_as->pt_lock);
+            KASSERT(victim_mapped(victim_as, victim_vaddr, padd));
+            swap_cached = pt_get_swap_cache(victim_as->pt, victim_vaddr, &offset);
+            pt_set_in_transit(victim_as->pt, victim_vaddr);
+            rwlock_release_write(victim_as->pt_lock);
+
+            //the owner may be running on any CPU
+            tlb_shootdown(victim_vaddr, 1);
+
+            zero = 0;
+            if (swap_cached){
+                //clean page with an up-to-date copy in swapfile: no need to write it again
+                vmstats_increment(VMSTATS_SWAP_CACHE_CLEAN_EVICTIONS);
+            }
+            else if (page_is_zero(padd)){
+                //no swap slot needed, next fault will be a demand-zero fill
+                zero = 1;
+                vmstats_increment(VMSTATS_ZERO_PAGES);
+            }
+            else {
+                //saves in offset the position in swapfile of victim
+                res = swap_out(padd, &offset);
+                if (res)
+                    panic("swap out failed\n");
+            }
+
+            rwlock_acquire_write(victim_as->pt_lock);
+            if (zero)
+                pt_set_zero(victim_as->pt, victim_vaddr);
+            else
+                pt_swap_out(victim_as->pt, victim_vaddr, offset);
+            rwlock_release_write(victim_as->pt_lock);
+            pt_wake_transit(victim_as);
 
+            *evicted = victim_vaddr;
+            
             spinlock_acquire(&coremap_lock);
-            lock_acquire(as->pt_lock);
-            pt_swap_out(as->pt, coremap[victim_tmp].vaddr, offset);
-            lock_release(as->pt_lock);
 
-            tlb_invalidate_entry(coremap[victim_tmp].vaddr);
-            
-            //update coremap
+            //update coremap: the frame was pinned, nobody else changed it
             KASSERT(coremap[victim_tmp].type == USER_ENTRY);
 			KASSERT(coremap[victim_tmp].alloc_size == 1);
+            KASSERT(coremap[victim_tmp].as == victim_as && coremap[victim_tmp].vaddr == victim_vaddr);
             coremap[victim_tmp].vaddr = vadd;
 			coremap[victim_tmp].as = as;
+            coremap[victim_tmp].evicting = 0;
+            coremap[victim_tmp].loading = 1;
 
-            victim_new = coremap[victim_tmp].next_allocated;
-            coremap[last_tmp].next_allocated = victim_tmp;
-			coremap[victim_tmp].next_allocated = invalid_ref;
-			coremap[victim_tmp].prev_allocated = last_tmp;
-			
-            spinlock_release(&coremap_lock);
+            //the queue may have changed during the swap out: move the frame to its end
+            remove_allocated(victim_tmp);
+            append_allocated(victim_tmp);
 
-            //update victim's info
-            spinlock_acquire(&victim_lock);
-			last_allocate = victim_tmp;
-            victim = victim_new;
-			spinlock_release(&victim_lock);
+            wchan_wakeall(evict_wchan, &coremap_lock);
+            spinlock_release(&coremap_lock);
         }
     }
 
@@ -360,64 +626,106 @@ paddr_t getppage_user(vaddr_t vadd){
 
 
 
+/*
+called by vm_fault() once the page from getppage_user() is in the page table: it can now be evicted
+*/
+void coremap_user_loaded(paddr_t paddr){
+    unsigned int found = paddr / PAGE_SIZE;
+
+    if (!isCoremapActive())
+        return;
+
+    KASSERT(found < num_ram_frames);
+
+    spinlock_acquire(&coremap_lock);
+    KASSERT(coremap[found].type == USER_ENTRY);
+    KASSERT(coremap[found].loading);
+    coremap[found].loading = 0;
+    spinlock_release(&coremap_lock);
+}
+
+
 /*
 frees a previuos allocated user page
 upgrades the linked list for victim's selection
 */
 void freeppage_user(paddr_t paddr){
-    paddr_t new_last_all, new_victim;
-
     if (isCoremapActive()){
         //page to free and checks
         int found = paddr / PAGE_SIZE;
         KASSERT((int)num_ram_frames > found);
 		KASSERT(coremap[found].alloc_size == 1);
 
-        //save previous victim's info
-        spinlock_acquire(&victim_lock);
-		new_last_all = last_allocate;
-		new_victim = victim;
-		spinlock_release(&victim_lock);
-
         //update allocation queue
         spinlock_acquire(&coremap_lock);
-        if (coremap[found].prev_allocated == invalid_ref){
-            //first element in queue
-            if (coremap[found].next_allocated == invalid_ref){
-                //only element in queue
-                new_victim = invalid_ref;
-                new_last_all = invalid_ref;
-            }
-            else {
-                //shift forward
-                coremap[coremap[found].next_allocated].prev_allocated = invalid_ref;
-                new_victim = coremap[found].next_allocated;
-            }
-        }
-        else {
-            //other elements before it in queue
-            if (coremap[found].next_allocated == invalid_ref){
-                //last one --> shift backward
-                coremap[coremap[found].prev_allocated].next_allocated = invalid_ref;
-                new_last_all = coremap[found].prev_allocated;
-            }
-            else {
-                //in the middle --> update both directions
-                coremap[coremap[found].next_allocated].prev_allocated = coremap[found].prev_allocated;
-				coremap[coremap[found].prev_allocated].next_allocated = coremap[found].next_allocated;
-            }
-        }
-        coremap[found].next_allocated = invalid_ref;
-        coremap[found].prev_allocated = invalid_ref;
+        KASSERT(!coremap[found].evicting);
+        coremap[found].loading = 0;
+        remove_allocated(found);
         spinlock_release(&coremap_lock);
 
         //free the memory, using self-defined functions
         freeppages(paddr, 1);
+    }
+}
+
+
+/*
+frees all the user pages owned by an address space (called when it is destroyed)
+single sweep of the coremap, instead of one freeppage_user() per page
+returns the number of freed pages
+*/
+unsigned int freeppages_user_as(struct addrspace *as){
+    unsigned int i, freed = 0;
+
+    KASSERT(as != NULL);
+
+    if (!isCoremapActive())
+        return 0;
+
+    spinlock_acquire(&coremap_lock);
+    i = 0;
+    while (i < num_ram_frames){
+        if (coremap[i].type == USER_ENTRY && coremap[i].as == as){
+            if (coremap[i].evicting){
+                //another fault is swapping this page out and still uses as: wait until it owns the frame
+                wchan_sleep(evict_wchan, &coremap_lock);
+                continue;
+            }
+
+            remove_allocated(i);
 
-        //update victim's info
-        spinlock_acquire(&victim_lock);
-		last_allocate = new_last_all;
-		victim = new_victim;
-		spinlock_release(&victim_lock);
+            coremap[i].type = FREED_ENTRY;
+            coremap[i].alloc_size = 0;
+            coremap[i].as = NULL;
+            coremap[i].vaddr = 0;
+            coremap[i].loading = 0;
+            freed++;
+        }
+        i++;
     }
+    spinlock_release(&coremap_lock);
+
+    return freed;
+}
+
+
+/*
+counts the user pages of an address space currently resident in memory
+*/
+unsigned int coremap_count_user_as(struct addrspace *as){
+    unsigned int i, n = 0;
+
+    KASSERT(as != NULL);
+
+    if (!isCoremapActive())
+        return 0;
+
+    spinlock_acquire(&coremap_lock);
+    for (i=0; i<num_ram_frames; i++){
+        if (coremap[i].type == USER_ENTRY && coremap[i].as == as)
+            n++;
+    }
+    spinlock_release(&coremap_lock);
+
+    return n;
 }
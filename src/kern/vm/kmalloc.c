@@ -30,7 +30,17 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
+#include "opt-paging.h"
+
+#if OPT_PAGING
+#include <coremap.h>
+#include <vmalloc.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -166,7 +176,8 @@ struct pageref {
  * OS/161 performance and scalability aren't super-critical.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock =
+	SPINLOCK_TICKET_INITIALIZER_NAMED("kmalloc_spinlock");
 
 ////////////////////////////////////////
 
@@ -816,6 +827,309 @@ kheap_printstats(void)
 
 ////////////////////////////////////////
 
+/*
+ * Allocation profiler.
+ *
+ * Always on and cheap enough for that: each kmalloc charges its
+ * caller (found with __builtin_return_address) in a small open
+ * addressing table, and the requested size in a log2 histogram.
+ * Frees cannot be charged back to a call site, since blocks do not
+ * record who allocated them (that is what LABELS is for), so
+ * per-site numbers are totals since the last reset.
+ *
+ * Every cpu has its own tables, updated with interrupts off and no
+ * lock; kheap_printprof adds them up. Live usage is counted in real
+ * block sizes, as the bytes allocated less the bytes freed on all
+ * cpus, since a block may be freed on another cpu than the one that
+ * allocated it. So the peak is only looked at every KHPROF_PEAKEVERY
+ * allocations of each cpu and when printing, and can miss a short
+ * spike.
+ */
+
+#define KHPROF_NSITES     128	/* must be a power of 2 */
+#define KHPROF_NBUCKETS   20	/* last bucket: 512K and up */
+#define KHPROF_NPRINT     16	/* sites shown by kheap_printprof */
+#define KHPROF_PEAKEVERY  32	/* allocations between two peak checks */
+
+struct khprof_site {
+	vaddr_t site;		/* return address of the kmalloc call */
+	unsigned count;		/* allocations */
+	size_t bytes;		/* bytes requested */
+};
+
+struct khprof_cpu {
+	struct khprof_site kc_sites[KHPROF_NSITES];
+	unsigned kc_other;		/* allocations not fitting the table */
+	unsigned kc_hist[KHPROF_NBUCKETS];
+	unsigned kc_nallocs, kc_nfrees, kc_nfailed;
+	uint64_t kc_allocbytes;		/* never reset */
+	uint64_t kc_freebytes;		/* never reset */
+};
+
+static struct khprof_cpu khprof_cpus[MAXCPUS];
+static volatile size_t khprof_peakbytes;
+
+/*
+ * Table of the current cpu. kmalloc is called before the cpus are
+ * set up, with only the boot cpu running.
+ */
+static
+struct khprof_cpu *
+khprof_curcpu(void)
+{
+	return &khprof_cpus[CURCPU_EXISTS() ? curcpu->c_number : 0];
+}
+
+/*
+ * Bytes in use on all cpus; also raises the peak if they are above
+ * it. The counters of the other cpus may be changing as we add them
+ * up, so this is approximate.
+ */
+static
+size_t
+khprof_livebytes(void)
+{
+	uint64_t allocbytes = 0, freebytes = 0;
+	size_t live;
+	unsigned i;
+
+	for (i = 0; i < MAXCPUS; i++) {
+		allocbytes += khprof_cpus[i].kc_allocbytes;
+		freebytes += khprof_cpus[i].kc_freebytes;
+	}
+	/* Never underflow, in case a block was charged a different size. */
+	live = allocbytes > freebytes ? allocbytes - freebytes : 0;
+	if (live > khprof_peakbytes) {
+		khprof_peakbytes = live;
+	}
+	return live;
+}
+
+/*
+ * Record an allocation of SZ bytes from SITE, using REALSZ bytes of
+ * memory (0 if it failed).
+ */
+static
+void
+khprof_alloc(vaddr_t site, size_t sz, size_t realsz)
+{
+	struct khprof_cpu *kc;
+	unsigned i, n, bucket;
+	bool checkpeak;
+	int spl;
+
+	for (bucket = 0; bucket < KHPROF_NBUCKETS - 1; bucket++) {
+		if ((sz >> (bucket + 1)) == 0) {
+			break;
+		}
+	}
+
+	spl = splhigh();
+	kc = khprof_curcpu();
+
+	if (realsz == 0) {
+		kc->kc_nfailed++;
+		splx(spl);
+		return;
+	}
+
+	kc->kc_nallocs++;
+	kc->kc_hist[bucket]++;
+	kc->kc_allocbytes += realsz;
+	checkpeak = kc->kc_nallocs % KHPROF_PEAKEVERY == 0;
+
+	i = (site >> 2) & (KHPROF_NSITES - 1);
+	for (n = 0; n < KHPROF_NSITES; n++) {
+		if (kc->kc_sites[i].site == site ||
+		    kc->kc_sites[i].site == 0) {
+			kc->kc_sites[i].site = site;
+			kc->kc_sites[i].count++;
+			kc->kc_sites[i].bytes += sz;
+			break;
+		}
+		i = (i + 1) & (KHPROF_NSITES - 1);
+	}
+	if (n == KHPROF_NSITES) {
+		kc->kc_other++;
+	}
+
+	splx(spl);
+
+	if (checkpeak) {
+		khprof_livebytes();
+	}
+}
+
+/*
+ * Record the free of a block using REALSZ bytes of memory.
+ */
+static
+void
+khprof_free(size_t realsz)
+{
+	struct khprof_cpu *kc;
+	int spl;
+
+	spl = splhigh();
+	kc = khprof_curcpu();
+	kc->kc_nfrees++;
+	kc->kc_freebytes += realsz;
+	splx(spl);
+}
+
+/*
+ * Add SITE, with COUNT allocations of BYTES bytes in all, to the
+ * merged table SITES.
+ */
+static
+void
+khprof_addsite(struct khprof_site *sites, unsigned *other,
+	       vaddr_t site, unsigned count, size_t bytes)
+{
+	unsigned i, n;
+
+	i = (site >> 2) & (KHPROF_NSITES - 1);
+	for (n = 0; n < KHPROF_NSITES; n++) {
+		if (sites[i].site == site || sites[i].site == 0) {
+			sites[i].site = site;
+			sites[i].count += count;
+			sites[i].bytes += bytes;
+			return;
+		}
+		i = (i + 1) & (KHPROF_NSITES - 1);
+	}
+	*other += count;
+}
+
+/*
+ * Print the profile: usage, size histogram, the call sites that
+ * allocated the most bytes, and how fragmented physical memory is.
+ */
+void
+kheap_printprof(void)
+{
+	/* Scratch space: too big for the kernel stack. */
+	static struct khprof_site sites[KHPROF_NSITES];
+	struct khprof_site top[KHPROF_NPRINT];
+	unsigned hist[KHPROF_NBUCKETS];
+	unsigned nallocs, nfrees, nfailed, other;
+	size_t curbytes, peakbytes;
+	struct khprof_cpu *kc;
+	unsigned i, j, ntop;
+#if OPT_PAGING
+	unsigned nfree, largest;
+#endif
+
+	/*
+	 * Add up the cpus. Their tables are not locked, so an entry
+	 * caught while it is updated may be off by one allocation.
+	 */
+	bzero(sites, sizeof(sites));
+	bzero(hist, sizeof(hist));
+	nallocs = nfrees = nfailed = other = 0;
+	for (i = 0; i < MAXCPUS; i++) {
+		kc = &khprof_cpus[i];
+		nallocs += kc->kc_nallocs;
+		nfrees += kc->kc_nfrees;
+		nfailed += kc->kc_nfailed;
+		other += kc->kc_other;
+		for (j = 0; j < KHPROF_NBUCKETS; j++) {
+			hist[j] += kc->kc_hist[j];
+		}
+		for (j = 0; j < KHPROF_NSITES; j++) {
+			if (kc->kc_sites[j].site != 0) {
+				khprof_addsite(sites, &other,
+					       kc->kc_sites[j].site,
+					       kc->kc_sites[j].count,
+					       kc->kc_sites[j].bytes);
+			}
+		}
+	}
+	curbytes = khprof_livebytes();
+	peakbytes = khprof_peakbytes;
+
+	/* Insertion sort of the sites with most bytes into top[]. */
+	ntop = 0;
+	for (i = 0; i < KHPROF_NSITES; i++) {
+		if (sites[i].site == 0) {
+			continue;
+		}
+		for (j = ntop; j > 0 &&
+			     top[j-1].bytes < sites[i].bytes; j--) {
+			if (j < KHPROF_NPRINT) {
+				top[j] = top[j-1];
+			}
+		}
+		if (j < KHPROF_NPRINT) {
+			top[j] = sites[i];
+			if (ntop < KHPROF_NPRINT) {
+				ntop++;
+			}
+		}
+	}
+
+	kprintf("Kernel heap profile:\n");
+	kprintf("    %u allocations, %u frees, %u failed\n",
+		nallocs, nfrees, nfailed);
+	kprintf("    in use: %zu bytes, peak: %zu bytes\n",
+		curbytes, peakbytes);
+
+	kprintf("Requested sizes:\n");
+	for (i = 0; i < KHPROF_NBUCKETS; i++) {
+		if (hist[i] == 0) {
+			continue;
+		}
+		if (i == KHPROF_NBUCKETS - 1) {
+			kprintf("    %7u+       %u\n", 1U << i, hist[i]);
+		}
+		else {
+			kprintf("    %7u-%-7u %u\n", 1U << i,
+				(2U << i) - 1, hist[i]);
+		}
+	}
+
+	kprintf("Top call sites (by bytes):\n");
+	for (i = 0; i < ntop; i++) {
+		kprintf("    0x%08lx  %8u allocs  %10zu bytes\n",
+			(unsigned long)top[i].site, top[i].count,
+			top[i].bytes);
+	}
+	if (other > 0) {
+		kprintf("    (%u allocations from untracked sites)\n", other);
+	}
+
+#if OPT_PAGING
+	coremap_fragstats(&nfree, &largest);
+	kprintf("Physical memory: %u free frames, largest free run %u, "
+		"fragmentation %u%%\n", nfree, largest,
+		nfree == 0 ? 0 : 100 - (largest * 100) / nfree);
+#endif
+}
+
+/*
+ * Clear the profile counters. Live usage is kept and the peak
+ * restarts from it.
+ */
+void
+kheap_resetprof(void)
+{
+	struct khprof_cpu *kc;
+	unsigned i;
+
+	/* Updates running meanwhile on other cpus may survive it. */
+	for (i = 0; i < MAXCPUS; i++) {
+		kc = &khprof_cpus[i];
+		bzero(kc->kc_sites, sizeof(kc->kc_sites));
+		bzero(kc->kc_hist, sizeof(kc->kc_hist));
+		kc->kc_other = 0;
+		kc->kc_nallocs = kc->kc_nfrees = kc->kc_nfailed = 0;
+	}
+	khprof_peakbytes = 0;
+	khprof_livebytes();
+}
+
+////////////////////////////////////////
+
 /*
  * Remove a pageref from both lists that it's on.
  */
@@ -1013,10 +1327,61 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+#if OPT_PAGING
+	/* Let kfree find this pageref straight from the page address. */
+	coremap_set_kref(prpage, pr);
+#endif
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Find the pageref for the subpage page holding PTRADDR, or NULL if
+ * it is not on any of our pages. With the coremap this is a constant
+ * time lookup; otherwise (or for pages the coremap does not track)
+ * walk the list of all pages.
+ */
+static
+struct pageref *
+lookup_pageref(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+	int blktype;
+#if OPT_PAGING
+	void *kref;
+#endif
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+#if OPT_PAGING
+	if (coremap_get_kref(ptraddr, &kref)) {
+		pr = kref;
+		if (pr != NULL) {
+			KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+			checksubpage(pr);
+		}
+		return pr;
+	}
+#endif
+
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+
+		/* check for corruption */
+		KASSERT(blktype>=0 && blktype<NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			return pr;
+		}
+	}
+
+	return NULL;
+}
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1035,6 +1400,9 @@ subpage_kfree(void *ptr)
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
+#if OPT_PAGING
+	void *kref;
+#endif
 
 	ptraddr = (vaddr_t)ptr;
 #ifdef GUARDS
@@ -1061,34 +1429,28 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
+#if OPT_PAGING
+	if (coremap_get_kref(ptraddr, &kref) && kref == NULL) {
+		/* Kernel page with no pageref - a whole-page allocation */
+		return -1;
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = lookup_pageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype >= 0 && blktype < NSIZES);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1108,6 +1470,8 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
+	khprof_free(sizes[blktype]);
+
 	/*
 	 * We probably ought to check for free twice by seeing if the block
 	 * is already on the free list. But that's expensive, so we don't.
@@ -1142,6 +1506,9 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+#if OPT_PAGING
+		coremap_set_kref(prpage, NULL);
+#endif
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1170,16 +1537,19 @@ void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
+	vaddr_t site;
+	void *ptr;
 #ifdef LABELS
 	vaddr_t label;
 #endif
 
-#ifdef LABELS
 #ifdef __GNUC__
-	label = (vaddr_t)__builtin_return_address(0);
+	site = (vaddr_t)__builtin_return_address(0);
 #else
 #error "Don't know how to get return address with this compiler"
 #endif /* __GNUC__ */
+#ifdef LABELS
+	label = site;
 #endif /* LABELS */
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
@@ -1190,19 +1560,32 @@ kmalloc(size_t sz)
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
+#if OPT_PAGING
+		/*
+		 * No run of contiguous free frames: build the block from
+		 * single frames mapped in kseg2 instead.
+		 */
+		if (address==0 && npages > 1) {
+			address = (vaddr_t)vmalloc(npages);
+		}
+#endif
 		if (address==0) {
+			khprof_alloc(site, sz, 0);
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
 
+		khprof_alloc(site, sz, npages * PAGE_SIZE);
 		return (void *)address;
 	}
 
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+	ptr = subpage_kmalloc(sz, label);
 #else
-	return subpage_kmalloc(sz);
+	ptr = subpage_kmalloc(sz);
 #endif
+	khprof_alloc(site, sz, ptr == NULL ? 0 : sizes[blocktype(checksz)]);
+	return ptr;
 }
 
 /*
@@ -1211,14 +1594,29 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
+	size_t realsz;
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#if OPT_PAGING
+	else if (VMALLOC_ADDR(ptr)) {
+		khprof_free(vmalloc_getsize(ptr) * PAGE_SIZE);
+		vfree(ptr);
+	}
+#endif
+	else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+#if OPT_PAGING
+		realsz = coremap_get_alloc_size((vaddr_t)ptr) * PAGE_SIZE;
+#else
+		/* dumbvm does not know the size of its blocks */
+		realsz = 0;
+#endif
+		khprof_free(realsz);
 		free_kpages((vaddr_t)ptr);
 	}
 }
-
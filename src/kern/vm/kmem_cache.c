@@ -0,0 +1,609 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+/*
+ * Object caches. See kmem_cache.h.
+ *
+ * A slab is one page: a header, then a stack of the indexes of the
+ * free objects, then the objects themselves. The free stack is kept
+ * outside the objects so that a free object keeps its constructed
+ * state. The header sits at the start of the page, so the slab of an
+ * object is found by masking its address.
+ */
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;
+	struct kmem_slab *ks_prev;
+	struct kmem_cache *ks_cache;
+	vaddr_t ks_objbase;		/* Address of object 0 */
+	unsigned ks_nobjs;		/* Objects in this slab */
+	unsigned ks_nfree;		/* Entries in use in ks_free[] */
+	uint16_t ks_free[];		/* Indexes of the free objects */
+};
+
+struct kmem_magazine {
+	unsigned km_count;
+	unsigned km_hits;		/* Allocations served from here */
+	void *km_objs[KMEM_MAGAZINE_SIZE];
+};
+
+/*
+ * Number of completely free slabs a cache keeps before it starts
+ * giving pages back.
+ */
+#define KMEM_MAX_EMPTY_SLABS 1
+
+#define KMEM_ALIGN(x) (((x) + 7) & ~(vaddr_t)7)
+
+/*
+ * All the caches that have been used, for stats and reclaim. The lock
+ * also protects kc_next, kc_listed, kc_refs and kc_dying of each cache.
+ */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER_NAMED("kmem_caches_lock");
+static struct kmem_cache *kmem_caches;
+
+////////////////////////////////////////////////////////////
+// slab lists
+
+static
+void
+slab_insert(struct kmem_slab **list, struct kmem_slab *slab)
+{
+	slab->ks_prev = NULL;
+	slab->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = slab;
+	}
+	*list = slab;
+}
+
+static
+void
+slab_remove(struct kmem_slab **list, struct kmem_slab *slab)
+{
+	if (slab->ks_prev != NULL) {
+		slab->ks_prev->ks_next = slab->ks_next;
+	}
+	else {
+		KASSERT(*list == slab);
+		*list = slab->ks_next;
+	}
+	if (slab->ks_next != NULL) {
+		slab->ks_next->ks_prev = slab->ks_prev;
+	}
+	slab->ks_next = slab->ks_prev = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// slabs
+
+static
+void
+kmem_cache_register(struct kmem_cache *kc)
+{
+	spinlock_acquire(&kmem_caches_lock);
+	if (!kc->kc_listed) {
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+		kc->kc_listed = true;
+	}
+	spinlock_release(&kmem_caches_lock);
+}
+
+static
+void
+kmem_cache_unlink(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+
+	KASSERT(spinlock_do_i_hold(&kmem_caches_lock));
+	KASSERT(kc->kc_refs == 0);
+
+	for (kcp = &kmem_caches; *kcp != NULL; kcp = &(*kcp)->kc_next) {
+		if (*kcp == kc) {
+			*kcp = kc->kc_next;
+			break;
+		}
+	}
+	kc->kc_listed = false;
+}
+
+/*
+ * Get a fresh page and lay out a slab on it. Called without the cache
+ * lock, since it may sleep; the new slab is private until inserted.
+ */
+static
+struct kmem_slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	vaddr_t page;
+	unsigned nobjs, i;
+
+	/* Largest count whose free stack and objects fit in the page. */
+	nobjs = (PAGE_SIZE - sizeof(struct kmem_slab)) /
+		(kc->kc_objsize + sizeof(uint16_t));
+	while (nobjs > 0 &&
+	       KMEM_ALIGN(sizeof(struct kmem_slab) + nobjs*sizeof(uint16_t))
+	       + nobjs * kc->kc_objsize > PAGE_SIZE) {
+		nobjs--;
+	}
+	KASSERT(nobjs > 0);
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	KASSERT(page % PAGE_SIZE == 0);
+
+	slab = (struct kmem_slab *)page;
+	slab->ks_next = slab->ks_prev = NULL;
+	slab->ks_cache = kc;
+	slab->ks_objbase = page +
+		KMEM_ALIGN(sizeof(struct kmem_slab) + nobjs*sizeof(uint16_t));
+	slab->ks_nobjs = nobjs;
+	slab->ks_nfree = nobjs;
+
+	/* Hand out the lowest addresses first. */
+	for (i=0; i<nobjs; i++) {
+		slab->ks_free[i] = nobjs - 1 - i;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor((void *)(slab->ks_objbase +
+					     i * kc->kc_objsize));
+		}
+	}
+
+	kmem_cache_register(kc);
+
+	return slab;
+}
+
+static
+void *
+slab_take(struct kmem_slab *slab, size_t objsize)
+{
+	unsigned index;
+
+	KASSERT(slab->ks_nfree > 0);
+	index = slab->ks_free[--slab->ks_nfree];
+	KASSERT(index < slab->ks_nobjs);
+	return (void *)(slab->ks_objbase + index * objsize);
+}
+
+static
+void
+slab_give(struct kmem_slab *slab, size_t objsize, void *obj)
+{
+	vaddr_t offset;
+
+	KASSERT((vaddr_t)obj >= slab->ks_objbase);
+	offset = (vaddr_t)obj - slab->ks_objbase;
+	if (offset % objsize != 0 || offset / objsize >= slab->ks_nobjs) {
+		panic("kmem_cache_free: invalid object %p\n", obj);
+	}
+	KASSERT(slab->ks_nfree < slab->ks_nobjs);
+	slab->ks_free[slab->ks_nfree++] = offset / objsize;
+}
+
+/*
+ * Put an object back in its slab. Returns a slab that became free and
+ * has to be given back with free_kpages (after dropping the lock), or
+ * NULL.
+ */
+static
+struct kmem_slab *
+kmem_slab_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *slab;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	slab = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(slab->ks_cache == kc);
+
+	slab_give(slab, kc->kc_objsize, obj);
+	KASSERT(kc->kc_nalloc > 0);
+	kc->kc_nalloc--;
+
+	if (slab->ks_nfree == 1) {
+		/* was full */
+		slab_remove(&kc->kc_full, slab);
+		slab_insert(&kc->kc_partial, slab);
+	}
+	if (slab->ks_nfree == slab->ks_nobjs) {
+		if (kc->kc_nempty >= KMEM_MAX_EMPTY_SLABS) {
+			slab_remove(&kc->kc_partial, slab);
+			kc->kc_nslabs--;
+			return slab;
+		}
+		kc->kc_nempty++;
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+// magazines
+
+/*
+ * Give the current cpu its magazine. Failure is harmless: the cpu
+ * just keeps using the slabs directly.
+ */
+static
+void
+kmem_magazine_create(struct kmem_cache *kc)
+{
+	struct kmem_magazine *mag;
+	int spl;
+
+	mag = kmalloc(sizeof(*mag));
+	if (mag == NULL) {
+		return;
+	}
+	mag->km_count = 0;
+	mag->km_hits = 0;
+
+	spl = splhigh();
+	if (kc->kc_mag[curcpu->c_number] == NULL) {
+		kc->kc_mag[curcpu->c_number] = mag;
+		mag = NULL;
+	}
+	splx(spl);
+
+	if (mag != NULL) {
+		/* someone beat us to it */
+		kfree(mag);
+	}
+}
+
+/*
+ * Take one object from the current cpu's magazine, or return NULL.
+ */
+static
+void *
+kmem_magazine_pop(struct kmem_cache *kc, bool *hasmag)
+{
+	struct kmem_magazine *mag;
+	void *obj = NULL;
+	int spl;
+
+	spl = splhigh();
+	mag = kc->kc_mag[curcpu->c_number];
+	*hasmag = (mag != NULL);
+	if (mag != NULL && mag->km_count > 0) {
+		obj = mag->km_objs[--mag->km_count];
+		mag->km_hits++;
+	}
+	splx(spl);
+
+	return obj;
+}
+
+/*
+ * Put one object in the current cpu's magazine. Returns false if the
+ * magazine is missing or full.
+ */
+static
+bool
+kmem_magazine_push(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_magazine *mag;
+	bool done = false;
+	int spl;
+
+	spl = splhigh();
+	mag = kc->kc_mag[curcpu->c_number];
+	if (mag != NULL && mag->km_count < KMEM_MAGAZINE_SIZE) {
+		mag->km_objs[mag->km_count++] = obj;
+		done = true;
+	}
+	splx(spl);
+
+	return done;
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct kmem_cache *kc;
+	unsigned i;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_objsize = KMEM_ALIGN(size);
+	kc->kc_ctor = ctor;
+	spinlock_init(&kc->kc_lock);
+	spinlock_setname(&kc->kc_lock, "kc_lock");
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nempty = 0;
+	kc->kc_nalloc = 0;
+	kc->kc_next = NULL;
+	kc->kc_listed = false;
+	kc->kc_refs = 0;
+	kc->kc_dying = false;
+	for (i=0; i<MAXCPUS; i++) {
+		kc->kc_mag[i] = NULL;
+	}
+
+	return kc;
+}
+
+/*
+ * Free a cache that is off the list of caches and that nobody uses
+ * any more.
+ */
+static
+void
+kmem_cache_teardown(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	unsigned i, j;
+
+	KASSERT(!kc->kc_listed);
+	KASSERT(kc->kc_refs == 0);
+
+	/* Empty all magazines. */
+	spinlock_acquire(&kc->kc_lock);
+	for (i=0; i<MAXCPUS; i++) {
+		if (kc->kc_mag[i] == NULL) {
+			continue;
+		}
+		for (j=0; j<kc->kc_mag[i]->km_count; j++) {
+			slab = kmem_slab_free(kc, kc->kc_mag[i]->km_objs[j]);
+			if (slab != NULL) {
+				/* free_kpages without the cache lock */
+				spinlock_release(&kc->kc_lock);
+				free_kpages((vaddr_t)slab);
+				spinlock_acquire(&kc->kc_lock);
+			}
+		}
+		kc->kc_mag[i]->km_count = 0;
+	}
+	KASSERT(kc->kc_nalloc == 0);
+	KASSERT(kc->kc_full == NULL);
+	spinlock_release(&kc->kc_lock);
+
+	for (i=0; i<MAXCPUS; i++) {
+		if (kc->kc_mag[i] != NULL) {
+			kfree(kc->kc_mag[i]);
+			kc->kc_mag[i] = NULL;
+		}
+	}
+
+	while ((slab = kc->kc_partial) != NULL) {
+		KASSERT(slab->ks_nfree == slab->ks_nobjs);
+		slab_remove(&kc->kc_partial, slab);
+		free_kpages((vaddr_t)slab);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	/* Off the list first, so that kmem_cache_reap_all leaves it alone. */
+	spinlock_acquire(&kmem_caches_lock);
+	if (kc->kc_refs > 0) {
+		/* Being reaped: the last walker tears it down. */
+		kc->kc_dying = true;
+		spinlock_release(&kmem_caches_lock);
+		return;
+	}
+	kmem_cache_unlink(kc);
+	spinlock_release(&kmem_caches_lock);
+
+	kmem_cache_teardown(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	void *obj;
+	bool hasmag;
+
+	if (CURCPU_EXISTS()) {
+		obj = kmem_magazine_pop(kc, &hasmag);
+		if (obj != NULL) {
+			return obj;
+		}
+		if (!hasmag) {
+			kmem_magazine_create(kc);
+		}
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+
+	slab = kc->kc_partial;
+	if (slab == NULL) {
+		/*
+		 * No free objects: make a new slab. As in kmalloc, the
+		 * lock is dropped while getting the page.
+		 */
+		spinlock_release(&kc->kc_lock);
+		slab = slab_create(kc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		slab_insert(&kc->kc_partial, slab);
+		kc->kc_nslabs++;
+		kc->kc_nempty++;
+	}
+
+	if (slab->ks_nfree == slab->ks_nobjs) {
+		KASSERT(kc->kc_nempty > 0);
+		kc->kc_nempty--;
+	}
+	obj = slab_take(slab, kc->kc_objsize);
+	if (slab->ks_nfree == 0) {
+		slab_remove(&kc->kc_partial, slab);
+		slab_insert(&kc->kc_full, slab);
+	}
+	kc->kc_nalloc++;
+
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *slab;
+
+	KASSERT(obj != NULL);
+	KASSERT(((struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME))->ks_cache
+		== kc);
+
+	if (CURCPU_EXISTS() && kmem_magazine_push(kc, obj)) {
+		return;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	slab = kmem_slab_free(kc, obj);
+	spinlock_release(&kc->kc_lock);
+
+	if (slab != NULL) {
+		free_kpages((vaddr_t)slab);
+	}
+}
+
+unsigned
+kmem_cache_reap(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab, *next, *freelist;
+	unsigned freed = 0;
+	bool hasmag;
+	void *obj;
+
+	/* Flush this cpu's magazine back into the slabs. */
+	if (CURCPU_EXISTS()) {
+		while ((obj = kmem_magazine_pop(kc, &hasmag)) != NULL) {
+			spinlock_acquire(&kc->kc_lock);
+			slab = kmem_slab_free(kc, obj);
+			spinlock_release(&kc->kc_lock);
+			if (slab != NULL) {
+				free_kpages((vaddr_t)slab);
+				freed++;
+			}
+		}
+	}
+
+	/* Take every completely free slab off the partial list. */
+	freelist = NULL;
+	spinlock_acquire(&kc->kc_lock);
+	for (slab = kc->kc_partial; slab != NULL; slab = next) {
+		next = slab->ks_next;
+		if (slab->ks_nfree == slab->ks_nobjs) {
+			slab_remove(&kc->kc_partial, slab);
+			slab_insert(&freelist, slab);
+			kc->kc_nslabs--;
+			KASSERT(kc->kc_nempty > 0);
+			kc->kc_nempty--;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	while ((slab = freelist) != NULL) {
+		slab_remove(&freelist, slab);
+		free_kpages((vaddr_t)slab);
+		freed++;
+	}
+
+	return freed;
+}
+
+/*
+ * Reap every cache, stopping once NPAGES pages have been released.
+ * This is the shrinker of the object caches.
+ *
+ * Each cache is reaped without kmem_caches_lock, since reaping calls
+ * free_kpages; a reference keeps the cache on the list (and alive)
+ * meanwhile, so its kc_next is still good afterwards. A cache that
+ * was destroyed while we held it is torn down here instead.
+ *
+ * Only the current cpu's magazines are flushed. The others are
+ * guarded by nothing but the spl of their own cpu, so emptying them
+ * from here would need a lock on every alloc and free. They hold at
+ * most KMEM_MAGAZINE_SIZE objects per cache, and each cpu flushes its
+ * own when it runs the shrinker.
+ */
+unsigned
+kmem_cache_reap_all(unsigned npages)
+{
+	struct kmem_cache *kc, *next, *dead;
+	unsigned freed = 0;
+
+	dead = NULL;
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	while (kc != NULL && freed < npages) {
+		kc->kc_refs++;
+		spinlock_release(&kmem_caches_lock);
+
+		freed += kmem_cache_reap(kc);
+
+		spinlock_acquire(&kmem_caches_lock);
+		next = kc->kc_next;
+		KASSERT(kc->kc_refs > 0);
+		kc->kc_refs--;
+		if (kc->kc_refs == 0 && kc->kc_dying) {
+			kmem_cache_unlink(kc);
+			/* off the list now, so kc_next can chain the dead */
+			kc->kc_next = dead;
+			dead = kc;
+		}
+		kc = next;
+	}
+	spinlock_release(&kmem_caches_lock);
+
+	while ((kc = dead) != NULL) {
+		dead = kc->kc_next;
+		kmem_cache_teardown(kc);
+	}
+
+	return freed;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned i, hits;
+
+	kprintf("Object caches:\n");
+	kprintf("    %-16s %6s %6s %8s %8s\n",
+		"name", "size", "slabs", "objects", "maghits");
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		hits = 0;
+		for (i=0; i<MAXCPUS; i++) {
+			if (kc->kc_mag[i] != NULL) {
+				hits += kc->kc_mag[i]->km_hits;
+			}
+		}
+		kprintf("    %-16s %6zu %6u %8u %8u\n", kc->kc_name,
+			kc->kc_objsize, kc->kc_nslabs, kc->kc_nalloc, hits);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
@@ -4,9 +4,12 @@
 #include <types.h>
 #include <current.h>
 #include <cpu.h>
+#include <membar.h>
 #include <machine/tlb.h>
 #include <vm.h>
+#include <elf.h>
 #include <synch.h>
+#include <wchan.h>
 #include <proc.h>
 
 #include <coremap.h>
@@ -17,25 +20,61 @@
 #include <vm_tlb.h>
 #include <addrspace.h>
 #include <vmstats.h>
+#include <vmalloc.h>
+#include <shrinker.h>
+#include <vmtrace.h>
 #include "opt-debug_paging.h"
 
 
 void vm_bootstrap(void) {
-    swapfile_init();
+    // shrinkers count their runs in vmstats, zswap registers one in swapfile_init()
     vmstats_init();
+    shrinker_init();
+    swapfile_init();
 }
 
 
 void vm_shutdown(void){
+    unsigned int tlb_cache_hit_count, tlb_cache_hit_free;
+    unsigned int tlb_evictions, tlb_premature, tlb_evicted_age;
+    unsigned int tlb_load_free, tlb_load_replace, tlb_invalidations;
+
     swapfile_close();
+    shrinker_shutdown();
+
+    // software TLB cache hits are counted per-CPU without locks: each one is a TLB fault solved by a reload
+    tlb_cache_hit_count = tlb_cache_hits(&tlb_cache_hit_free);
+    vmstats_add(VMSTATS_TLB_CACHE_HITS, tlb_cache_hit_count);
+    vmstats_add(VMSTATS_TLB_FAULTS, tlb_cache_hit_count);
+    vmstats_add(VMSTATS_TLB_FAULTS_WITH_FREE, tlb_cache_hit_free);
+    vmstats_add(VMSTATS_TLB_FAULTS_WITH_REPLACE, tlb_cache_hit_count - tlb_cache_hit_free);
+    vmstats_add(VMSTATS_TLB_RELOADS, tlb_cache_hit_count);
+
+    // TLB replacement quality, also counted per-CPU without locks
+    tlb_replacement_stats(&tlb_evictions, &tlb_premature, &tlb_evicted_age);
+    vmstats_add(VMSTATS_TLB_PREMATURE_EVICTIONS, tlb_premature);
+    vmstats_add(VMSTATS_TLB_EVICTED_AGE, tlb_evicted_age);
+
+    // TLB loads and flushes, per-CPU too: they happen with interrupts off, where the vmstats lock cannot be taken
+    tlb_load_stats(&tlb_load_free, &tlb_load_replace, &tlb_invalidations);
+    vmstats_add(VMSTATS_TLB_FAULTS_WITH_FREE, tlb_load_free);
+    vmstats_add(VMSTATS_TLB_FAULTS_WITH_REPLACE, tlb_load_replace);
+    vmstats_add(VMSTATS_TLB_INVALIDATIONS, tlb_invalidations);
+
     vmstats_print();
     vmstats_destroy();
 }
 
 
+// IPI from tlb_shootdown(): drop the range here, then tell the sender
 void vm_tlbshootdown(const struct tlbshootdown *ts) {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+    unsigned int i;
+
+    for (i = 0; i < ts->ts_npages; i++)
+        tlb_invalidate_entry(ts->ts_start + i * PAGE_SIZE);
+
+    membar_store_store();
+    ts->ts_done[curcpu->c_number] = true;
 }
 
 
@@ -51,21 +90,61 @@ void vm_can_sleep(void) {
 }
 
 
+// Sleeps until an in-transit page of as has been loaded. Called with pt_lock held, for writing if
+// write is set: it is dropped while asleep and taken back in the same mode.
+// pt_transit_lock is taken before pt_lock is dropped, and the loader marks the page valid under pt_lock
+// and only then wakes us under pt_transit_lock, so the wakeup cannot be missed.
+static void pt_wait_transit(struct addrspace *as, int write) {
+    spinlock_acquire(&as->pt_transit_lock);
+    if (write)
+        rwlock_release_write(as->pt_lock);
+    else
+        rwlock_release_read(as->pt_lock);
+    wchan_sleep(as->pt_transit_wchan, &as->pt_transit_lock);
+    spinlock_release(&as->pt_transit_lock);
+
+    if (write)
+        rwlock_acquire_write(as->pt_lock);
+    else
+        rwlock_acquire_read(as->pt_lock);
+}
+
+
+// Wakes up the faults waiting in pt_wait_transit(): call after the page has been set under pt_lock
+void pt_wake_transit(struct addrspace *as) {
+    spinlock_acquire(&as->pt_transit_lock);
+    wchan_wakeall(as->pt_transit_wchan, &as->pt_transit_lock);
+    spinlock_release(&as->pt_transit_lock);
+}
+
+
 // Function vm_fault() is called inside "mips_trap()" in file "trap.c"
 int vm_fault(int faulttype, vaddr_t faultaddress) {
     uint8_t page_status;
-    off_t swap_offset;
+    off_t swap_offset = 0;
+    int swap_cached = 0;
     uint32_t perm;
-	paddr_t paddr;
+	paddr_t paddr, cur_paddr;
 	struct addrspace *as;
     segment *sg;
     pagetable *pt;
+    vaddr_t victim = 0;
+    int write_locked = 0;
+    int trace_path = VMTRACE_RELOAD;
+    unsigned int lat_path = VMSTATS_LAT_RELOAD;
+    struct vmstats_stamp fault_start;
 
     vaddr_t aligned_faultaddress = faultaddress & PAGE_FRAME;
 
+    vmstats_stamp(&fault_start);
+
+    // Kernel mappings of vmalloc: may come with spinlocks held, must not sleep
+    if (VMALLOC_ADDR(faultaddress)) {
+        return vmalloc_fault(faulttype, faultaddress);
+    }
+
     switch(faulttype) {
-        case VM_FAULT_READONLY:
-		    panic("Attempt by an application to modify its text section : got VM_FAULT_READONLY\n");
+        case VM_FAULT_READONLY:     // allowed only for clean swap-cached pages, checked below
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -77,6 +156,16 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
         return EFAULT;
     }
 
+    // Fast path: translation still in this CPU's software TLB cache.
+    // p_addrspace is only changed by the process itself, so no need for proc_getas() and its spinlock
+    if (faulttype != VM_FAULT_READONLY && curproc->p_addrspace != NULL &&
+            tlb_cache_refill(curproc->p_addrspace, faultaddress)) {
+        curproc->p_vmstats.pv_tlb_cache_hits++;
+        vmstats_latency(VMSTATS_LAT_CACHE, &fault_start);
+        vmtrace_record(faulttype, faultaddress, VMTRACE_CACHE, 0, &fault_start);
+        return 0;
+    }
+
     as = proc_getas();
     if (as == NULL) {
         return EFAULT;
@@ -87,52 +176,127 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
         return EFAULT;
     }
 
-    if (sg->base_vaddr == USERSTACK - sg->mem_size) {       // it's a stack page
-        
-        paddr = getppage_user(aligned_faultaddress);
-        bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
-        vmstats_increment(VMSTATS_PAGE_FAULTS_ZEROED);
-    
-    } else {
+    // Management of the page inside the PT (stack pages included)
+    pt = as->pt;
+
+    if (faulttype == VM_FAULT_READONLY) {
+        if (!(sg->perm & PF_W))
+            panic("Attempt by an application to modify its text section : got VM_FAULT_READONLY\n");
+
+        // First write to a swap-cached page: its copy in the swapfile becomes stale.
+        // The entry is made writable under pt_lock, and only while the page is still in memory: if it was
+        // evicted meanwhile, the read-only entry is dropped and the write faults again
+        rwlock_acquire_write(as->pt_lock);
+        page_status = pt_get_page(pt, faultaddress, &paddr, &perm);
+        if (page_status == PT_ENTRY_VALID) {
+            swap_cached = pt_get_swap_cache(pt, faultaddress, &swap_offset);
+            if (swap_cached)
+                pt_drop_swap_cache(pt, faultaddress);
+            tlb_set_dirty(aligned_faultaddress, paddr);
+            tlb_cache_insert(as, aligned_faultaddress, paddr, perm);
+        }
+        else
+            tlb_invalidate_entry(aligned_faultaddress);
+        rwlock_release_write(as->pt_lock);
 
-        // Management of the page inside the PT 
-        pt = as->pt;
+        if (swap_cached)
+            process_swap_free(swap_offset);
+
+        vmtrace_record(faulttype, faultaddress, VMTRACE_DIRTY, 0, &fault_start);
+
+        return 0;
+    }
 
-        lock_acquire(as->pt_lock);
+    // Look the page up for reading, so that TLB reloads do not serialize; a page that has to be
+    // loaded is looked up again for writing, to mark it in transit
+    rwlock_acquire_read(as->pt_lock);
+    for (;;) {
         page_status = pt_get_page(pt, faultaddress, &paddr, &perm);
-        lock_release(as->pt_lock);
 
-        if (page_status == PT_ENTRY_EMPTY) {                // not-initialized (0)
-            paddr = getppage_user(aligned_faultaddress); 
+        // Another fault is already loading this page: wait for it instead of loading it twice
+        if (page_status == PT_ENTRY_IN_TRANSIT) {
+            pt_wait_transit(as, write_locked);
+            continue;
+        }
+        if (page_status == PT_ENTRY_VALID || write_locked)
+            break;
 
-            load_page_from_elf(sg, faultaddress, paddr);
+        rwlock_release_read(as->pt_lock);
+        rwlock_acquire_write(as->pt_lock);
+        write_locked = 1;
+    }
 
-            lock_acquire(as->pt_lock);  
-            pt_add_entry(pt, faultaddress, paddr, perm);
-            lock_release(as->pt_lock);
-            
-            vmstats_increment(VMSTATS_PAGE_FAULTS_ELF);
-            vmstats_increment(VMSTATS_PAGE_FAULTS_DISK);
+    if (page_status == PT_ENTRY_SWAPPED_OUT)
+        swap_offset = pt_get_page_swapfile_offset(pt, faultaddress);
+    else if (page_status == PT_ENTRY_VALID)
+        swap_cached = pt_get_swap_cache(pt, faultaddress, &swap_offset);
 
-        } else if (page_status == PT_ENTRY_SWAPPED_OUT) {   // swapped-out (1)
-            paddr = getppage_user(aligned_faultaddress);
-            lock_acquire(as->pt_lock);  
+    // The disk I/O is done without holding pt_lock, so other faults in this address space can proceed
+    if (page_status == PT_ENTRY_EMPTY || page_status == PT_ENTRY_SWAPPED_OUT || page_status == PT_ENTRY_ZERO)
+        pt_set_in_transit(pt, faultaddress);
 
-            swap_offset = pt_get_page_swapfile_offset(pt, faultaddress);
-            swap_in(paddr, swap_offset);
-            pt_swap_in(pt, faultaddress, paddr, perm);
+    if (write_locked)
+        rwlock_release_write(as->pt_lock);
+    else
+        rwlock_release_read(as->pt_lock);
 
-            lock_release(as->pt_lock);
+    if ((page_status == PT_ENTRY_EMPTY && sg->base_vaddr == USERSTACK - sg->mem_size) || page_status == PT_ENTRY_ZERO) {
+        // stack page never touched (0) or all-zero page dropped at eviction (4): demand-zero fill
+        paddr = getppage_user(aligned_faultaddress, &victim);
+        perm = sg->perm;
+        trace_path = VMTRACE_ZERO;
+        lat_path = VMSTATS_LAT_ZERO;
 
-            vmstats_increment(VMSTATS_PAGE_FAULTS_DISK);
+        bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
 
-        } else if (page_status == PT_ENTRY_VALID) {         // valid (2)
-            // nothing to do
-            vmstats_increment(VMSTATS_TLB_RELOADS);
-        }
+        rwlock_acquire_write(as->pt_lock);
+        pt_add_entry(pt, faultaddress, paddr, perm);
+        rwlock_release_write(as->pt_lock);
+        coremap_user_loaded(paddr);
+        pt_wake_transit(as);
+
+        curproc->p_vmstats.pv_faults_zeroed++;
 
+    } else if (page_status == PT_ENTRY_EMPTY) {         // not-initialized (0)
+        paddr = getppage_user(aligned_faultaddress, &victim);
+        perm = sg->perm;
+        trace_path = VMTRACE_ELF;
+        lat_path = VMSTATS_LAT_ELF;
+
+        load_page_from_elf(sg, faultaddress, paddr);
+
+        rwlock_acquire_write(as->pt_lock);
+        pt_add_entry(pt, faultaddress, paddr, perm);
+        rwlock_release_write(as->pt_lock);
+        coremap_user_loaded(paddr);
+        pt_wake_transit(as);
+        
+        curproc->p_vmstats.pv_faults_elf++;
+
+    } else if (page_status == PT_ENTRY_SWAPPED_OUT) {   // swapped-out (1)
+        paddr = getppage_user(aligned_faultaddress, &victim);
+        perm = sg->perm;
+        trace_path = VMTRACE_SWAP;
+        lat_path = VMSTATS_LAT_SWAPFILE;
+
+        swap_in(paddr, swap_offset, &swap_cached);
+
+        rwlock_acquire_write(as->pt_lock);
+        pt_swap_in(pt, faultaddress, paddr, perm, swap_cached);
+        rwlock_release_write(as->pt_lock);
+        coremap_user_loaded(paddr);
+        pt_wake_transit(as);
+
+        curproc->p_vmstats.pv_faults_swapfile++;
+
+    } else if (page_status == PT_ENTRY_VALID) {         // valid (2)
+        // nothing to do
+        curproc->p_vmstats.pv_tlb_reloads++;
     }
 
+    if (victim != 0)
+        curproc->p_vmstats.pv_swapouts++;
+
     /* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
@@ -153,9 +317,23 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 #endif
 
     // Management of the entry inside TLB 
-    tlb_load((uint32_t)aligned_faultaddress, (uint32_t)paddr, perm);
+    // done under pt_lock, and only if the page is still on paddr: it may have been evicted since pt_lock
+    // was released, and a stale translation in the TLB cache would keep being refilled. An eviction
+    // shoots the entry down once it gets pt_lock. If the page is gone, the access just faults again.
+    rwlock_acquire_read(as->pt_lock);
+    if (pt_get_page(pt, faultaddress, &cur_paddr, &perm) == PT_ENTRY_VALID && cur_paddr == paddr) {
+        // swap-cached pages are loaded read-only, so that the first write is caught (VM_FAULT_READONLY)
+        swap_cached = pt_get_swap_cache(pt, faultaddress, &swap_offset);
+        tlb_load((uint32_t)aligned_faultaddress, (uint32_t)paddr, swap_cached ? (perm & ~PF_W) : perm);
+        tlb_cache_insert(as, aligned_faultaddress, paddr, swap_cached ? (perm & ~PF_W) : perm);
+    }
+    rwlock_release_read(as->pt_lock);
+
+    // per-process counters, no lock needed: added to the global vmstats when the process goes away
+    curproc->p_vmstats.pv_tlb_faults++;
 
-    vmstats_increment(VMSTATS_TLB_FAULTS);
+    vmstats_latency(lat_path, &fault_start);
+    vmtrace_record(faulttype, faultaddress, trace_path, victim, &fault_start);
 
     return 0;
 }
@@ -3,32 +3,58 @@
 #include <vm.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <swapfile.h>
+#include <kmem_cache.h>
 
-pagetable *pt_init(vaddr_t pt_start_vaddr1, uint32_t pt_num_pages1, vaddr_t pt_start_vaddr2, uint32_t pt_num_pages2) {
+static struct kmem_cache pagetable_cache = KMEM_CACHE_INITIALIZER("pagetable", sizeof(pagetable), NULL);
+
+// Index of the entry describing vaddr inside pt->pages
+static uint32_t pt_get_index(pagetable *pt, vaddr_t vaddr) {
+    KASSERT(vaddr >= pt->start_vaddr1);
+    KASSERT((vaddr - pt->start_vaddr1 <= PAGE_SIZE * pt->num_pages1) || (vaddr - pt->start_vaddr2 <= PAGE_SIZE * pt->num_pages2) || (vaddr - pt->start_vaddr3 <= PAGE_SIZE * pt->num_pages3));
+
+    vaddr_t aligned_vaddr = vaddr & PAGE_FRAME;
+    uint32_t pt_index;
+    if (aligned_vaddr >= pt->start_vaddr3)
+        pt_index = ((aligned_vaddr - pt->start_vaddr3) / PAGE_SIZE) + pt->num_pages1 + pt->num_pages2;
+    else if (aligned_vaddr >= pt->start_vaddr2)
+        pt_index = ((aligned_vaddr - pt->start_vaddr2) / PAGE_SIZE) + pt->num_pages1;
+    else
+        pt_index = (aligned_vaddr - pt->start_vaddr1) / PAGE_SIZE;
+
+    return pt_index;
+}
+
+pagetable *pt_init(vaddr_t pt_start_vaddr1, uint32_t pt_num_pages1, vaddr_t pt_start_vaddr2, uint32_t pt_num_pages2, vaddr_t pt_start_vaddr3, uint32_t pt_num_pages3) {
     
     uint32_t i;
 
     KASSERT(pt_num_pages1 != 0);
     KASSERT(pt_num_pages2 != 0);
+    KASSERT(pt_num_pages3 != 0);
+    KASSERT(pt_start_vaddr3 > pt_start_vaddr2);
 
-    pagetable *pt = kmalloc(sizeof(pagetable));
+    pagetable *pt = kmem_cache_alloc(&pagetable_cache);
 
     if (pt == NULL) 
         return NULL;
     
     pt->num_pages1 = pt_num_pages1;
     pt->num_pages2 = pt_num_pages2;
+    pt->num_pages3 = pt_num_pages3;
     pt->start_vaddr1 = pt_start_vaddr1 & PAGE_FRAME;
     pt->start_vaddr2 = pt_start_vaddr2 & PAGE_FRAME;
-    pt->pages = kmalloc((pt_num_pages1 + pt_num_pages2) * sizeof(pt_entry));
+    pt->start_vaddr3 = pt_start_vaddr3 & PAGE_FRAME;
+    pt->pages = kmalloc((pt_num_pages1 + pt_num_pages2 + pt_num_pages3) * sizeof(pt_entry));
 
     if (pt->pages == NULL) {
-        kfree(pt);
+        kmem_cache_free(&pagetable_cache, pt);
         return NULL;
     }
 
-    for (i = 0; i < (pt_num_pages1 + pt_num_pages2); i++) {
+    for (i = 0; i < (pt_num_pages1 + pt_num_pages2 + pt_num_pages3); i++) {
         pt->pages[i].status = PT_ENTRY_EMPTY;
+        pt->pages[i].swap_cached = 0;
     }
 
     return pt;
@@ -37,11 +63,11 @@ pagetable *pt_init(vaddr_t pt_start_vaddr1, uint32_t pt_num_pages1, vaddr_t pt_s
 int pt_copy(pagetable *old, pagetable **ret) {
     KASSERT(old != NULL);
 
-    pagetable *new_pt = pt_init(old->start_vaddr1, old->num_pages1, old->start_vaddr2, old->num_pages2);
+    pagetable *new_pt = pt_init(old->start_vaddr1, old->num_pages1, old->start_vaddr2, old->num_pages2, old->start_vaddr3, old->num_pages3);
     if (new_pt == NULL)
         return ENOMEM;
 
-    for (uint32_t i = 0; i < (old->num_pages1 + old->num_pages2); i++) {
+    for (uint32_t i = 0; i < (old->num_pages1 + old->num_pages2 + old->num_pages3); i++) {
         new_pt->pages[i].paddr = old->pages[i].paddr;
         new_pt->pages[i].perm = old->pages[i].perm;
         new_pt->pages[i].status = old->pages[i].status;
@@ -59,37 +85,22 @@ void pt_add_entry(pagetable *pt, vaddr_t vaddr, paddr_t paddr, uint32_t perm) {
     KASSERT(pt != NULL);
     KASSERT(pt->pages != NULL);
 
-    KASSERT(vaddr >= pt->start_vaddr1);
-    KASSERT((vaddr - pt->start_vaddr1 <= PAGE_SIZE * pt->num_pages1) || (vaddr - pt->start_vaddr2 <= PAGE_SIZE * pt->num_pages2));
-
-    vaddr_t aligned_vaddr = vaddr & PAGE_FRAME;
-    uint32_t pt_index;
-    if (aligned_vaddr >= pt->start_vaddr2)
-        pt_index = ((aligned_vaddr - pt->start_vaddr2) / PAGE_SIZE) + pt->num_pages1;
-    else
-        pt_index = (aligned_vaddr - pt->start_vaddr1) / PAGE_SIZE;
+    uint32_t pt_index = pt_get_index(pt, vaddr);
     
-    KASSERT(pt_index < pt->num_pages1 + pt->num_pages2);    
-    KASSERT(pt->pages[pt_index].status == PT_ENTRY_EMPTY || pt->pages[pt_index].status == PT_ENTRY_SWAPPED_OUT);
+    KASSERT(pt_index < pt->num_pages1 + pt->num_pages2 + pt->num_pages3);    
+    KASSERT(pt->pages[pt_index].status != PT_ENTRY_VALID);
 
     pt->pages[pt_index].paddr = paddr;
     pt->pages[pt_index].perm = perm;
     pt->pages[pt_index].status = PT_ENTRY_VALID;
+    pt->pages[pt_index].swap_cached = 0;
 }
 
 uint8_t pt_get_page(pagetable *pt, vaddr_t vaddr, paddr_t *paddr, uint32_t *perm) {
     KASSERT(pt != NULL);
     KASSERT(pt->pages != NULL);
 
-    KASSERT(vaddr >= pt->start_vaddr1);
-    KASSERT((vaddr - pt->start_vaddr1 <= PAGE_SIZE * pt->num_pages1) || (vaddr - pt->start_vaddr2 <= PAGE_SIZE * pt->num_pages2));
-
-    vaddr_t aligned_vaddr = vaddr & PAGE_FRAME;
-    uint32_t pt_index;
-    if (aligned_vaddr >= pt->start_vaddr2)
-        pt_index = ((aligned_vaddr - pt->start_vaddr2) / PAGE_SIZE) + pt->num_pages1;
-    else
-        pt_index = (aligned_vaddr - pt->start_vaddr1) / PAGE_SIZE;
+    uint32_t pt_index = pt_get_index(pt, vaddr);
 
     if (pt->pages[pt_index].status == PT_ENTRY_VALID) {
         *paddr = pt->pages[pt_index].paddr;
@@ -106,28 +117,89 @@ uint8_t pt_get_page(pagetable *pt, vaddr_t vaddr, paddr_t *paddr, uint32_t *perm
     return pt->pages[pt_index].status;
 }
 
-void pt_swap_in(pagetable *pt, vaddr_t vaddr, paddr_t paddr, uint32_t perm) {
+// If swap_cached, the swap slot stays reserved (swapfile_offset is kept) until the page is dirtied
+void pt_swap_in(pagetable *pt, vaddr_t vaddr, paddr_t paddr, uint32_t perm, int swap_cached) {
     pt_add_entry(pt, vaddr, paddr, perm);
+
+    pt->pages[pt_get_index(pt, vaddr)].swap_cached = swap_cached;
 }
 
+// Evicted page (set in transit by the evictor) is now at swapfile_offset
 void pt_swap_out(pagetable *pt, vaddr_t vaddr, off_t swapfile_offset) {
     KASSERT(pt != NULL);
     KASSERT(pt->pages != NULL);
 
-    KASSERT(vaddr >= pt->start_vaddr1);
-    KASSERT((vaddr - pt->start_vaddr1 <= PAGE_SIZE * pt->num_pages1) || (vaddr - pt->start_vaddr2 <= PAGE_SIZE * pt->num_pages2));
+    uint32_t pt_index = pt_get_index(pt, vaddr);
 
-    vaddr_t aligned_vaddr = vaddr & PAGE_FRAME;
-    uint32_t pt_index;
-    if (aligned_vaddr >= pt->start_vaddr2)
-        pt_index = ((aligned_vaddr - pt->start_vaddr2) / PAGE_SIZE) + pt->num_pages1;
-    else
-        pt_index = (aligned_vaddr - pt->start_vaddr1) / PAGE_SIZE;
-
-    KASSERT(pt->pages[pt_index].status == PT_ENTRY_VALID);
+    KASSERT(pt->pages[pt_index].status == PT_ENTRY_IN_TRANSIT);
 
     pt->pages[pt_index].status = PT_ENTRY_SWAPPED_OUT;
     pt->pages[pt_index].swapfile_offset = swapfile_offset;
+    pt->pages[pt_index].swap_cached = 0;
+}
+
+// Mark the page as being loaded, or evicted if it is valid: faults on it will wait until
+// pt_add_entry/pt_swap_in, or pt_swap_out/pt_set_zero
+void pt_set_in_transit(pagetable *pt, vaddr_t vaddr) {
+    KASSERT(pt != NULL);
+    KASSERT(pt->pages != NULL);
+
+    uint32_t pt_index = pt_get_index(pt, vaddr);
+
+    KASSERT(pt->pages[pt_index].status == PT_ENTRY_EMPTY || pt->pages[pt_index].status == PT_ENTRY_SWAPPED_OUT || pt->pages[pt_index].status == PT_ENTRY_ZERO || pt->pages[pt_index].status == PT_ENTRY_VALID);
+
+    pt->pages[pt_index].status = PT_ENTRY_IN_TRANSIT;
+}
+
+// Evicted page was all zeroes: no swap slot, the next fault refills it with zeroes
+void pt_set_zero(pagetable *pt, vaddr_t vaddr) {
+    KASSERT(pt != NULL);
+    KASSERT(pt->pages != NULL);
+
+    uint32_t pt_index = pt_get_index(pt, vaddr);
+
+    KASSERT(pt->pages[pt_index].status == PT_ENTRY_IN_TRANSIT);
+
+    pt->pages[pt_index].status = PT_ENTRY_ZERO;
+}
+
+// Returns true if the page is valid and clean with a copy in the swapfile, whose offset is saved in swapfile_offset
+int pt_get_swap_cache(pagetable *pt, vaddr_t vaddr, off_t *swapfile_offset) {
+    KASSERT(pt != NULL);
+    KASSERT(pt->pages != NULL);
+
+    uint32_t pt_index = pt_get_index(pt, vaddr);
+
+    if (pt->pages[pt_index].status != PT_ENTRY_VALID || !pt->pages[pt_index].swap_cached)
+        return 0;
+
+    *swapfile_offset = pt->pages[pt_index].swapfile_offset;
+    return 1;
+}
+
+// The page is going to be modified: its swapfile copy is no longer valid
+void pt_drop_swap_cache(pagetable *pt, vaddr_t vaddr) {
+    KASSERT(pt != NULL);
+    KASSERT(pt->pages != NULL);
+
+    uint32_t pt_index = pt_get_index(pt, vaddr);
+
+    KASSERT(pt->pages[pt_index].status == PT_ENTRY_VALID);
+
+    pt->pages[pt_index].swap_cached = 0;
+}
+
+// Release every swap slot still referenced by the page table (swapped-out or swap-cached pages)
+void pt_free_swap_slots(pagetable *pt) {
+    KASSERT(pt != NULL);
+    KASSERT(pt->pages != NULL);
+
+    for (uint32_t i = 0; i < (pt->num_pages1 + pt->num_pages2 + pt->num_pages3); i++) {
+        if (pt->pages[i].status == PT_ENTRY_SWAPPED_OUT || (pt->pages[i].status == PT_ENTRY_VALID && pt->pages[i].swap_cached)) {
+            process_swap_free(pt->pages[i].swapfile_offset);
+            pt->pages[i].swap_cached = 0;
+        }
+    }
 }
 
 void pt_destroy(pagetable *pt) {
@@ -135,22 +207,14 @@ void pt_destroy(pagetable *pt) {
     KASSERT(pt->pages != NULL);
 
     kfree(pt->pages);
-    kfree(pt);
+    kmem_cache_free(&pagetable_cache, pt);
 }
 
 off_t pt_get_page_swapfile_offset(pagetable *pt, vaddr_t vaddr) {
     KASSERT(pt != NULL);
     KASSERT(pt->pages != NULL);
 
-    KASSERT(vaddr >= pt->start_vaddr1);
-    KASSERT((vaddr - pt->start_vaddr1 <= PAGE_SIZE * pt->num_pages1) || (vaddr - pt->start_vaddr2 <= PAGE_SIZE * pt->num_pages2));
-
-    vaddr_t aligned_vaddr = vaddr & PAGE_FRAME;
-    uint32_t pt_index;
-    if (aligned_vaddr >= pt->start_vaddr2)
-        pt_index = ((aligned_vaddr - pt->start_vaddr2) / PAGE_SIZE) + pt->num_pages1;
-    else
-        pt_index = (aligned_vaddr - pt->start_vaddr1) / PAGE_SIZE;
+    uint32_t pt_index = pt_get_index(pt, vaddr);
 
     KASSERT(pt->pages[pt_index].status == PT_ENTRY_SWAPPED_OUT);
 
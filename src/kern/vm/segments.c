@@ -1,6 +1,9 @@
 #include <segments.h>
 #include <elf.h>
 #include <lib.h>
+#include <kmem_cache.h>
+
+static struct kmem_cache segment_cache = KMEM_CACHE_INITIALIZER("segment", sizeof(segment), NULL);
 
 segment *segment_init(uint32_t perm, vaddr_t base_vaddr, off_t base_vaddr_offset, off_t file_offset, size_t file_size, size_t mem_size, size_t num_pages, segment *next_segment) {
 
@@ -8,7 +11,10 @@ segment *segment_init(uint32_t perm, vaddr_t base_vaddr, off_t base_vaddr_offset
     KASSERT(num_pages > 0);
     KASSERT(perm & PF_R || perm & PF_W || perm & PF_X);
 
-    segment *seg = kmalloc(sizeof(segment));
+    segment *seg = kmem_cache_alloc(&segment_cache);
+    if (seg == NULL)
+        return NULL;
+
     seg->base_vaddr = base_vaddr;
     seg->base_vaddr_offset = base_vaddr_offset;
     seg->file_offset = file_offset;
@@ -26,7 +32,7 @@ void segment_destroy(segment *seg) {
         seg = seg->next_segment;
     }
 
-    kfree(seg->next_segment);
+    kmem_cache_free(&segment_cache, seg->next_segment);
     seg->next_segment = NULL;
 }
 
@@ -38,5 +44,5 @@ void segments_destroy_linked_list(segment *seg) {
         segment_destroy(int_seg);
     }
 
-    kfree(seg);
+    kmem_cache_free(&segment_cache, seg);
 }
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <current.h>
+#include <cpu.h>
+#include <kmem_cache.h>
+#include <shrinker.h>
+#include <vmstats.h>
+
+/*
+Registry of the shrinkers, in registration order.
+Only one thread runs the shrinkers at a time: the others (and the shrinkers
+themselves, if they allocate memory) find shrinker_running set and give up
+at once, instead of waiting on locks that the running shrinkers may need.
+*/
+
+static struct spinlock shrinker_lock = SPINLOCK_INITIALIZER_NAMED("shrinker_lock");
+static struct shrinker *shrinkers = NULL;
+static bool shrinker_running = false;
+static bool shrinker_active = false;
+
+static struct shrinker kmem_cache_shrinker = {
+    .name = "kmem_cache",
+    .shrink = kmem_cache_reap_all,
+    .next = NULL,
+};
+
+
+/*
+enables the shrinkers (vmstats must already be initialized)
+*/
+void shrinker_init(void){
+    spinlock_acquire(&shrinker_lock);
+    shrinker_active = true;
+    spinlock_release(&shrinker_lock);
+
+    shrinker_register(&kmem_cache_shrinker);
+}
+
+
+/*
+stops calling the shrinkers, the registered ones may still unregister
+*/
+void shrinker_shutdown(void){
+    shrinker_unregister(&kmem_cache_shrinker);
+
+    spinlock_acquire(&shrinker_lock);
+    shrinker_active = false;
+    spinlock_release(&shrinker_lock);
+}
+
+
+/*
+waits for a run in progress to finish (shrinker_lock held, and held again on return)
+*/
+static void shrinker_wait_idle(void){
+    while (shrinker_running) {
+        spinlock_release(&shrinker_lock);
+        thread_yield();
+        spinlock_acquire(&shrinker_lock);
+    }
+}
+
+
+void shrinker_register(struct shrinker *s){
+    struct shrinker **p;
+
+    KASSERT(s != NULL && s->shrink != NULL);
+
+    spinlock_acquire(&shrinker_lock);
+    shrinker_wait_idle();
+    for (p = &shrinkers; *p != NULL; p = &(*p)->next)
+        KASSERT(*p != s);
+    s->next = NULL;
+    *p = s;
+    spinlock_release(&shrinker_lock);
+}
+
+
+void shrinker_unregister(struct shrinker *s){
+    struct shrinker **p;
+
+    spinlock_acquire(&shrinker_lock);
+    shrinker_wait_idle();
+
+    for (p = &shrinkers; *p != NULL; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            s->next = NULL;
+            break;
+        }
+    }
+    spinlock_release(&shrinker_lock);
+}
+
+
+/*
+called by the page allocator when it cannot find npages free frames
+returns the pages released by the shrinkers (0 if they could not be run from here)
+*/
+unsigned int shrinker_run(unsigned int npages){
+    struct shrinker *s;
+    unsigned int freed = 0;
+
+    // the shrinkers do not sleep, but take spinlocks and free memory
+    if (!CURCPU_EXISTS() || curthread->t_in_interrupt || curcpu->c_spinlocks > 0)
+        return 0;
+
+    spinlock_acquire(&shrinker_lock);
+    if (!shrinker_active || shrinker_running) {
+        spinlock_release(&shrinker_lock);
+        return 0;
+    }
+    shrinker_running = true;
+    s = shrinkers;
+    spinlock_release(&shrinker_lock);
+
+    // the list cannot change while shrinker_running is set
+    for (; s != NULL && freed < npages; s = s->next)
+        freed += s->shrink(npages - freed);
+
+    spinlock_acquire(&shrinker_lock);
+    shrinker_running = false;
+    spinlock_release(&shrinker_lock);
+
+    vmstats_increment(VMSTATS_SHRINKER_RUNS);
+    vmstats_add(VMSTATS_SHRINKER_PAGES, freed);
+
+    return freed;
+}
@@ -7,10 +7,13 @@
 #include <bitmap.h>
 #include <swapfile.h>
 #include <vmstats.h>
+#include <zswap.h>
+
+#include "opt-zswap.h"
 
 
 //spinlock for mutex to swapfile and bitmap
-struct spinlock swapfile_lock = SPINLOCK_INITIALIZER;
+struct spinlock swapfile_lock = SPINLOCK_INITIALIZER_NAMED("swapfile_lock");
 
 //vnode for swapfile
 struct vnode *swapfile;
@@ -32,6 +35,10 @@ int swapfile_init(void){
         panic("Failed to open swapfile\n");
     
     swapfile_map = bitmap_create(SWAP_SIZE/PAGE_SIZE);
+
+#if OPT_ZSWAP
+    zswap_init(SWAP_SIZE/PAGE_SIZE);
+#endif
     
     return 0;
 }
@@ -44,6 +51,10 @@ int swapfile_close(void){
     if (swapfile == NULL || swapfile_map == NULL)
         panic("Trying to close a null swapfile\n");
 
+#if OPT_ZSWAP
+    zswap_close();
+#endif
+
     vfs_close(swapfile);
     bitmap_destroy(swapfile_map);
 
@@ -60,8 +71,6 @@ int swap_out(paddr_t paddr, off_t *swap_offset){
     unsigned int index;
     int res;
     off_t offset;
-    struct iovec iov;
-    struct uio u;
     
     KASSERT(paddr != 0);
 
@@ -77,27 +86,49 @@ int swap_out(paddr_t paddr, off_t *swap_offset){
     if (offset > SWAP_SIZE)
         panic("Swapfile's page out of bound\n");
 
+    //save position in swapfile in order to get it back later directly
+    *swap_offset = offset;
+
+#if OPT_ZSWAP
+    //compressed pool first, the slot stays reserved so that the offset is still unique
+    if (zswap_store(index, paddr) == 0)
+        return 0;
+#endif
+
     //write swapped-out page in offset position of swapfile (temporary parking when memory is full)
-    uio_kinit(&iov, &u, (void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE, offset, UIO_WRITE);
+    swap_write_slot(index, (void *) PADDR_TO_KVADDR(paddr));
+
+    return 0;
+}
+
+
+/*
+writes a page image to an already reserved slot of the swapfile
+used by swap_out() and by the compressed pool when it gives pages back to the swapfile
+*/
+void swap_write_slot(unsigned int index, void *kbuf){
+    struct iovec iov;
+    struct uio u;
+
+    uio_kinit(&iov, &u, kbuf, PAGE_SIZE, (off_t)index * PAGE_SIZE, UIO_WRITE);
     VOP_WRITE(swapfile, &u);
     if (u.uio_resid != 0) {
         panic("Cannot write page to swapfile\n");
     }
 
-    //save position in swapfile in order to get it back later directly
-    *swap_offset = offset;
-
     vmstats_increment(VMSTATS_SWAPFILE_WRITES);
-
-    return 0;
 }
 
 
 /*
-swap-in operation, so remove a page from swapfile (invalid the index of bitmap)
-parameters: physical address of page to swap-in, page offset in swapfile in order to select it directly 
+swap-in operation, the page is read back from swapfile
+the slot is kept reserved as swap cache (swap_cached set), so that the page can be evicted again
+without writing it as long as it stays clean: process_swap_free() releases it
+pages found in the compressed pool are dropped from it, and their slot is released at once
+parameters: physical address of page to swap-in, page offset in swapfile in order to select it directly,
+pointer to swap cache flag
 */
-int swap_in(paddr_t paddr, off_t swap_offset){
+int swap_in(paddr_t paddr, off_t swap_offset, int *swap_cached){
     int index;
     struct iovec iov;
     struct uio u;
@@ -113,15 +144,27 @@ int swap_in(paddr_t paddr, off_t swap_offset){
         panic("No swapped pages found at this address\n");
     spinlock_release(&swapfile_lock);
 
-    //trying to read at that address (no delete, just invalid the bitmap)
+#if OPT_ZSWAP
+    if (zswap_load(index, paddr) == 0) {
+        spinlock_acquire(&swapfile_lock);
+        bitmap_unmark(swapfile_map, index);
+        spinlock_release(&swapfile_lock);
+
+        *swap_cached = 0;
+
+        vmstats_increment(VMSTATS_PAGE_FAULTS_SWAPFILE);
+
+        return 0;
+    }
+#endif
+
+    //trying to read at that address (no delete, the bitmap entry stays set for the swap cache)
     uio_kinit(&iov, &u, (void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE, swap_offset, UIO_READ);
     VOP_READ(swapfile, &u);
     if (u.uio_resid != 0) 
         panic("Failed to read the requested page from swapfile\n");
 
-    spinlock_acquire(&swapfile_lock);
-    bitmap_unmark(swapfile_map, index);
-    spinlock_release(&swapfile_lock);
+    *swap_cached = 1;
 
     vmstats_increment(VMSTATS_PAGE_FAULTS_SWAPFILE);
 
@@ -147,6 +190,10 @@ int process_swap_free(off_t swap_offset){
         panic("No swapped pages found at this address\n");
     spinlock_release(&swapfile_lock);
 
+#if OPT_ZSWAP
+    zswap_invalidate(index);
+#endif
+
     //free entry from bitmap
     spinlock_acquire(&swapfile_lock);
     bitmap_unmark(swapfile_map, index);
@@ -6,58 +6,206 @@
 #include <machine/tlb.h>
 #include <vm_tlb.h>
 #include <spl.h>
-#include <vmstats.h>
 #include <lib.h>
+#include <current.h>
+#include <cpu.h>
+#include <membar.h>
+#include <platform/maxcpus.h>
 #include "opt-debug_paging.h"
 
 #if OPT_DEBUG_PAGING
-#include <current.h>
 #include <proc.h>
 #include <thread.h>
 #endif
 
 
-// Round Robin TLB replacement algorithm
-int tlb_get_rr_victim(void) {
-    int victim;
-    static unsigned int next_victim = 0;
-    victim = next_victim;
-    next_victim = (next_victim + 1) % NUM_TLB;
-    return victim;
+/*
+Per-CPU software TLB cache: direct-mapped on the virtual page number, it keeps recent
+(as, vpn) -> entrylo translations so that a TLB miss can be refilled without going
+through segments and page table. Entries belong to a generation: tlb_invalidate()
+starts a new one, which drops the whole cache of that CPU in O(1).
+*/
+#define TLB_CACHE_SIZE (PAGE_SIZE / sizeof(struct tlb_cache_entry))
+
+struct tlb_cache_entry {
+    uint32_t gen;               // generation the entry was loaded in
+    struct addrspace *as;       // owner address space
+    vaddr_t vpn;                // page-aligned virtual address
+    uint32_t entrylo;           // translation as written in the hardware TLB
+};
+
+// allocated on first insert by each CPU (one page each)
+static struct tlb_cache_entry *tlb_cache[MAXCPUS];
+static uint32_t tlb_cache_gen[MAXCPUS];
+// hits are counted without locks, merged into vmstats at shutdown
+static unsigned int tlb_cache_hit_count[MAXCPUS];
+static unsigned int tlb_cache_hit_free_count[MAXCPUS];     // hits that found a free slot
+
+
+/*
+Per-CPU replacement bookkeeping. A shadow copy of the valid bits finds a free slot
+without reading the TLB back, and the refill time of each slot (a per-CPU counter of
+refills) lets the victim be the least recently refilled of a few sampled slots,
+instead of a blind round robin shared by all CPUs.
+Recently evicted pages are remembered too: one refilled again within NUM_TLB refills
+of its eviction counts as a premature eviction.
+*/
+#define TLB_VICTIM_SAMPLE 8
+#define TLB_EVICTED_SIZE 64
+
+// wired slots always look valid, so they are never taken as free slots
+#define TLB_WIRED_MASK ((1U << TLB_WIRED_SLOTS) - 1)
+
+struct tlb_evicted {
+    vaddr_t vpn;                // page-aligned virtual address, 0 if none
+    uint32_t stamp;             // clock at eviction
+};
+
+struct tlb_shadow {
+    uint32_t valid[NUM_TLB / 32];           // bit set: slot holds a valid entry
+    uint32_t stamp[NUM_TLB];                // clock at the last refill of each slot
+    uint32_t clock;                         // refills done by this CPU
+    unsigned int hand;                      // first slot sampled at next eviction
+    vaddr_t wired[TLB_WIRED_SLOTS];         // page owning each wired slot, 0 if none
+    struct tlb_evicted evicted[TLB_EVICTED_SIZE];
+    // counted without locks, merged into vmstats at shutdown
+    unsigned int evictions;
+    unsigned int premature;
+    uint64_t evicted_age;                   // sum of the ages (in refills) of evicted entries
+    unsigned int loads_free;                // tlb_load() calls that found a free slot
+    unsigned int loads_replace;             // tlb_load() calls that replaced an entry
+    unsigned int invalidations;             // full flushes by tlb_invalidate()
+};
+
+static struct tlb_shadow tlb_shadow[MAXCPUS];
+
+// position of the lowest bit set in a (non-zero) word
+static const uint8_t tlb_debruijn[32] = {
+    0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+    31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+};
+
+static int tlb_lowest_bit(uint32_t x) {
+    return tlb_debruijn[((x & -x) * 0x077CB531U) >> 27];
+}
+
+
+static void tlb_shadow_set(struct tlb_shadow *sh, int slot) {
+    sh->valid[slot / 32] |= 1U << (slot % 32);
+    sh->stamp[slot] = sh->clock;
+}
+
+
+static void tlb_shadow_clear(struct tlb_shadow *sh, int slot) {
+    if (slot >= TLB_WIRED_SLOTS)
+        sh->valid[slot / 32] &= ~(1U << (slot % 32));
+}
+
+
+static void tlb_shadow_reset(struct tlb_shadow *sh) {
+    bzero(sh->valid, sizeof(sh->valid));
+    sh->valid[0] = TLB_WIRED_MASK;
+}
+
+
+/*
+Choose the slot for a new entry (interrupts must be off) and account for it:
+the wired slot of a pinned page, else a free slot if there is one, otherwise the
+oldest refill among TLB_VICTIM_SAMPLE unwired slots.
+was_free tells the caller whether an entry was thrown out.
+*/
+int tlb_get_victim(uint32_t entryhi, int *was_free) {
+    struct tlb_shadow *sh = &tlb_shadow[curcpu->c_number];
+    struct tlb_evicted *ev;
+    uint32_t v_hi, p_lo, age, oldest;
+    unsigned int i, w;
+    int slot = -1;
+
+    sh->clock++;
+
+    for (i = 0; i < TLB_WIRED_SLOTS; i++) {
+        if (sh->wired[i] != 0 && sh->wired[i] == (entryhi & PAGE_FRAME)) {
+            *was_free = 1;
+            sh->stamp[i] = sh->clock;
+            return i;
+        }
+    }
+
+    ev = &sh->evicted[(entryhi >> 12) % TLB_EVICTED_SIZE];
+    if (ev->vpn == (entryhi & PAGE_FRAME) && sh->clock - ev->stamp <= NUM_TLB) {
+        sh->premature++;
+        ev->vpn = 0;
+    }
+
+    for (w = 0; w < NUM_TLB / 32 && slot < 0; w++) {
+        if (~sh->valid[w] != 0)
+            slot = w * 32 + tlb_lowest_bit(~sh->valid[w]);
+    }
+
+    *was_free = (slot >= 0);
+
+    if (slot < 0) {
+        oldest = 0;
+        for (i = 0; i < TLB_VICTIM_SAMPLE; i++) {
+            w = TLB_WIRED_SLOTS + (sh->hand + i) % (NUM_TLB - TLB_WIRED_SLOTS);
+            age = sh->clock - sh->stamp[w];
+            if (slot < 0 || age > oldest) {
+                slot = w;
+                oldest = age;
+            }
+        }
+        sh->hand = (sh->hand + TLB_VICTIM_SAMPLE) % (NUM_TLB - TLB_WIRED_SLOTS);
+
+        tlb_read(&v_hi, &p_lo, slot);
+        ev = &sh->evicted[(v_hi >> 12) % TLB_EVICTED_SIZE];
+        ev->vpn = v_hi & PAGE_FRAME;
+        ev->stamp = sh->clock;
+
+        sh->evictions++;
+        sh->evicted_age += oldest;
+    }
+
+    tlb_shadow_set(sh, slot);
+
+    return slot;
+}
+
+
+// Valid entry, dirty (i.e. writable) only if perm allows writes
+static uint32_t tlb_make_entrylo(uint32_t entrylo, uint32_t perm) {
+    entrylo = entrylo | TLBLO_VALID;
+    if (perm & PF_W) {  // if it is writable, set the dirty bit
+        entrylo = entrylo | TLBLO_DIRTY;
+    }
+
+    return entrylo;
 }
 
 
 // Load a new entry in tlb
 void tlb_load(uint32_t entryhi, uint32_t entrylo, uint32_t perm) {
-    uint32_t v_hi, p_lo;
-    int i, victim=-1, spl, index;
+    struct tlb_shadow *sh;
+    int victim=-1, spl, index, was_free;
 
     // Disable interrupts on this CPU while frobbing the TLB
 	spl = splhigh();
+    sh = &tlb_shadow[curcpu->c_number];
     index = tlb_probe(entryhi, 0);
 
+    // per-CPU counters: vmstats_increment() takes a sleep lock
     if (index < 0) {
-        for (i = 0; i < NUM_TLB; i++) {
-            tlb_read(&v_hi, &p_lo, i);
-            if (!(p_lo & TLBLO_VALID)) {
-                victim=i;   
-                vmstats_increment(VMSTATS_TLB_FAULTS_WITH_FREE);            
-                break;
-            }
-        }
-        if(victim == -1) {  // no free entry, use round robin
-            victim = tlb_get_rr_victim();
-            vmstats_increment(VMSTATS_TLB_FAULTS_WITH_REPLACE);
-        } 
+        victim = tlb_get_victim(entryhi, &was_free);
+        if (was_free)
+            sh->loads_free++;
+        else
+            sh->loads_replace++;
     } else {
         victim = index;
-        vmstats_increment(VMSTATS_TLB_FAULTS_WITH_REPLACE);
+        tlb_shadow_set(sh, victim);
+        sh->loads_replace++;
     }
 
-    entrylo = entrylo | TLBLO_VALID;
-    if (perm & PF_W) {  // if it is writable, set the dirty bit
-        entrylo = entrylo | TLBLO_DIRTY;
-    }
+    entrylo = tlb_make_entrylo(entrylo, perm);
 
     tlb_write(entryhi, entrylo, victim);
 
@@ -82,6 +230,11 @@ void tlb_invalidate(void) {
         tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
     }
 
+    // drop the software cache and the shadow valid bits too
+    tlb_cache_gen[curcpu->c_number]++;
+    tlb_shadow_reset(&tlb_shadow[curcpu->c_number]);
+    tlb_shadow[curcpu->c_number].invalidations++;
+
     splx(spl);
     
 #if OPT_DEBUG_PAGING
@@ -95,12 +248,46 @@ void tlb_invalidate(void) {
     }
 #endif
 
-    vmstats_increment(VMSTATS_TLB_INVALIDATIONS);
-
     return;
 }
 
 
+// Give the wired slots of this CPU to the pinned pages vpns[0..n-1], loaded on their next miss
+void tlb_set_wired(const vaddr_t *vpns, unsigned int n) {
+    struct tlb_shadow *sh;
+    unsigned int i;
+    int spl;
+
+    KASSERT(n <= TLB_WIRED_SLOTS);
+
+    // Disable interrupts on this CPU while frobbing the TLB
+    spl = splhigh();
+
+    sh = &tlb_shadow[curcpu->c_number];
+    for (i = 0; i < TLB_WIRED_SLOTS; i++) {
+        sh->wired[i] = i < n ? (vpns[i] & PAGE_FRAME) : 0;
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    sh->valid[0] |= TLB_WIRED_MASK;
+
+    splx(spl);
+}
+
+
+// Drop the software cache entry of vaddr on this CPU (interrupts must be off)
+static void tlb_cache_invalidate_entry(vaddr_t vaddr) {
+    struct tlb_cache_entry *cache = tlb_cache[curcpu->c_number];
+    struct tlb_cache_entry *e;
+
+    if (cache == NULL)
+        return;
+
+    e = &cache[(vaddr >> 12) % TLB_CACHE_SIZE];
+    if (e->vpn == (vaddr & PAGE_FRAME))
+        e->as = NULL;
+}
+
+
 void tlb_invalidate_entry(vaddr_t vaddr) {
 	int i, spl;
 
@@ -108,10 +295,193 @@ void tlb_invalidate_entry(vaddr_t vaddr) {
 	spl = splhigh();
 
     // clear the valid bits
-    if((i = tlb_probe(vaddr, 0)) >= 0)
+    if((i = tlb_probe(vaddr, 0)) >= 0) {
         tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        tlb_shadow_clear(&tlb_shadow[curcpu->c_number], i);
+    }
+
+    tlb_cache_invalidate_entry(vaddr);
     
     splx(spl);
 
     return;
+}
+
+
+// Invalidate npages pages from vaddr on every CPU, and wait until all of them are done.
+// The others answer from an interrupt, so the caller must hold no spinlocks and have
+// interrupts on: a CPU spinning for one of our locks could never get to it.
+void tlb_shootdown(vaddr_t vaddr, unsigned int npages) {
+    struct tlbshootdown ts;
+    volatile bool done[MAXCPUS];
+    unsigned int i, sent, n;
+    int spl;
+
+    KASSERT(curcpu->c_spinlocks == 0);
+    KASSERT(curthread->t_curspl == IPL_NONE);
+
+    for (i = 0; i < MAXCPUS; i++)
+        done[i] = false;
+    ts.ts_start = vaddr;
+    ts.ts_npages = npages;
+    ts.ts_done = done;
+
+    // no migration between the IPIs and the local flush, or one CPU would be left out
+    spl = splhigh();
+    sent = ipi_tlbshootdown_broadcast(&ts);
+    for (i = 0; i < npages; i++)
+        tlb_invalidate_entry(vaddr + i * PAGE_SIZE);
+    splx(spl);
+
+    do {
+        n = 0;
+        for (i = 0; i < MAXCPUS; i++)
+            n += done[i] ? 1 : 0;
+    } while (n < sent);
+    membar_any_any();
+}
+
+
+// Make an already loaded entry writable (first write to a clean page), if it still maps paddr:
+// any other entry for vaddr is stale and is dropped instead
+void tlb_set_dirty(vaddr_t vaddr, paddr_t paddr) {
+    uint32_t v_hi, p_lo;
+    int i, spl;
+
+    // Disable interrupts on this CPU while frobbing the TLB
+    spl = splhigh();
+
+    if((i = tlb_probe(vaddr, 0)) >= 0) {
+        tlb_read(&v_hi, &p_lo, i);
+        if ((p_lo & TLBLO_PPAGE) == (paddr & PAGE_FRAME)) {
+            tlb_write(v_hi, p_lo | TLBLO_DIRTY, i);
+        } else {
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            tlb_shadow_clear(&tlb_shadow[curcpu->c_number], i);
+        }
+    }
+
+    // the cached translation is no longer up to date
+    tlb_cache_invalidate_entry(vaddr);
+
+    splx(spl);
+
+    return;
+}
+
+
+// Try to refill a TLB miss from the software cache: no locks, no segment or page table walk
+int tlb_cache_refill(struct addrspace *as, vaddr_t vaddr) {
+    struct tlb_cache_entry *cache, *e;
+    unsigned int cpu;
+    int spl, hit = 0, was_free;
+
+    // Disable interrupts on this CPU while frobbing the TLB
+    spl = splhigh();
+
+    cpu = curcpu->c_number;
+    cache = tlb_cache[cpu];
+    if (cache != NULL) {
+        e = &cache[(vaddr >> 12) % TLB_CACHE_SIZE];
+        if (e->as == as && e->gen == tlb_cache_gen[cpu] && e->vpn == (vaddr & PAGE_FRAME)) {
+            // it was a miss, so vaddr is not in the TLB: no need to probe
+            tlb_write(e->vpn, e->entrylo, tlb_get_victim(e->vpn, &was_free));
+            tlb_cache_hit_count[cpu]++;
+            if (was_free)
+                tlb_cache_hit_free_count[cpu]++;
+            hit = 1;
+        }
+    }
+
+    splx(spl);
+
+    return hit;
+}
+
+
+// Remember a translation just loaded in the TLB by vm_fault()
+void tlb_cache_insert(struct addrspace *as, vaddr_t vaddr, paddr_t paddr, uint32_t perm) {
+    struct tlb_cache_entry *cache, *e;
+    unsigned int cpu;
+    int spl;
+
+    cpu = curcpu->c_number;
+    if (tlb_cache[cpu] == NULL) {
+        // may sleep, so it is done before disabling interrupts
+        cache = kmalloc(TLB_CACHE_SIZE * sizeof(struct tlb_cache_entry));
+        if (cache == NULL)
+            return;
+        bzero(cache, TLB_CACHE_SIZE * sizeof(struct tlb_cache_entry));
+
+        spl = splhigh();
+        if (tlb_cache[cpu] == NULL) {
+            tlb_cache[cpu] = cache;
+            cache = NULL;
+        }
+        splx(spl);
+
+        if (cache != NULL)
+            kfree(cache);
+    }
+
+    spl = splhigh();
+
+    // we may have been moved to another CPU while sleeping
+    cpu = curcpu->c_number;
+    cache = tlb_cache[cpu];
+    if (cache != NULL) {
+        e = &cache[(vaddr >> 12) % TLB_CACHE_SIZE];
+        e->as = as;
+        e->gen = tlb_cache_gen[cpu];
+        e->vpn = vaddr & PAGE_FRAME;
+        e->entrylo = tlb_make_entrylo(paddr & PAGE_FRAME, perm);
+    }
+
+    splx(spl);
+}
+
+
+// Number of TLB misses served by the software cache (all CPUs)
+unsigned int tlb_cache_hits(unsigned int *with_free) {
+    unsigned int i, hits = 0;
+
+    *with_free = 0;
+    for (i = 0; i < MAXCPUS; i++) {
+        hits += tlb_cache_hit_count[i];
+        *with_free += tlb_cache_hit_free_count[i];
+    }
+
+    return hits;
+}
+
+
+// Replacement quality, summed over all CPUs: evictions, premature ones and average age (in refills)
+void tlb_replacement_stats(unsigned int *evictions, unsigned int *premature, unsigned int *avg_age) {
+    uint64_t age = 0;
+    unsigned int i;
+
+    *evictions = 0;
+    *premature = 0;
+    for (i = 0; i < MAXCPUS; i++) {
+        *evictions += tlb_shadow[i].evictions;
+        *premature += tlb_shadow[i].premature;
+        age += tlb_shadow[i].evicted_age;
+    }
+
+    *avg_age = *evictions > 0 ? age / *evictions : 0;
+}
+
+
+// Loads by vm_fault() into a free slot or over another entry, and full flushes, summed over all CPUs
+void tlb_load_stats(unsigned int *with_free, unsigned int *with_replace, unsigned int *invalidations) {
+    unsigned int i;
+
+    *with_free = 0;
+    *with_replace = 0;
+    *invalidations = 0;
+    for (i = 0; i < MAXCPUS; i++) {
+        *with_free += tlb_shadow[i].loads_free;
+        *with_replace += tlb_shadow[i].loads_replace;
+        *invalidations += tlb_shadow[i].invalidations;
+    }
 }
\ No newline at end of file
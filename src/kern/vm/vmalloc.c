@@ -0,0 +1,268 @@
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <spinlock.h>
+#include <spl.h>
+#include <current.h>
+#include <cpu.h>
+#include <thread.h>
+#include <vm.h>
+#include <machine/tlb.h>
+#include <coremap.h>
+#include <vm_tlb.h>
+#include <vmalloc.h>
+
+/*
+Each page of the kseg2 window has one slot in vmalloc_map, holding the physical
+frame mapped there. Slots of an allocation are reserved (VMALLOC_RESERVED) before
+their frames are allocated, so the lock is never held across alloc_kpages().
+The first slot of an allocation also records its length in vmalloc_npages.
+
+Everything is protected by a spinlock only: vmalloc_fault() runs on TLB misses
+of kernel code, which may already hold spinlocks and must not sleep.
+
+Other CPUs may still have a freed page in their TLB, so a freed slot is not
+free (0) yet but VMALLOC_STALE: its frame is given back at once, since nobody
+may touch a freed address, but the address is handed out again only after
+vmalloc_flush_stale() has shot it down on every CPU. Thus a free slot has no
+translation anywhere, and vmalloc() needs no invalidation of its own.
+*/
+
+#define VMALLOC_RESERVED ((paddr_t) 1)     //allocation in progress
+#define VMALLOC_STALE ((paddr_t) 2)        //freed, may still be in some TLB
+#define VMALLOC_FLUSHING ((paddr_t) 3)     //stale, being shot down
+
+//slot states are not page aligned, frames are (and frame 0 is never in RAM)
+#define VMALLOC_HAS_FRAME(p) ((p) >= PAGE_SIZE)
+
+static paddr_t vmalloc_map[VMALLOC_NPAGES];
+static uint16_t vmalloc_npages[VMALLOC_NPAGES];
+static unsigned vmalloc_nstale = 0;
+static struct spinlock vmalloc_lock = SPINLOCK_INITIALIZER_NAMED("vmalloc_lock");
+
+
+static vaddr_t vmalloc_index_to_vaddr(unsigned index){
+    return VMALLOC_START + index * PAGE_SIZE;
+}
+
+
+static unsigned vmalloc_vaddr_to_index(vaddr_t vaddr){
+    return (vaddr - VMALLOC_START) / PAGE_SIZE;
+}
+
+
+/*
+releases the frames of slots [start, start + npages) and makes the slots stale
+slots still in the reserved state (allocation failed midway) have no frame
+*/
+static void vmalloc_release(unsigned start, unsigned npages){
+    unsigned i;
+    paddr_t paddr;
+
+    for (i = start; i < start + npages; i++) {
+        spinlock_acquire(&vmalloc_lock);
+        paddr = vmalloc_map[i];
+        vmalloc_map[i] = VMALLOC_RESERVED;
+        spinlock_release(&vmalloc_lock);
+
+        // only this CPU: the others are dealt with before the slot is reused
+        tlb_invalidate_entry(vmalloc_index_to_vaddr(i));
+
+        if (VMALLOC_HAS_FRAME(paddr))
+            free_kpages(PADDR_TO_KVADDR(paddr));
+    }
+
+    spinlock_acquire(&vmalloc_lock);
+    for (i = start; i < start + npages; i++)
+        vmalloc_map[i] = VMALLOC_STALE;
+    vmalloc_nstale += npages;
+    vmalloc_npages[start] = 0;
+    spinlock_release(&vmalloc_lock);
+}
+
+
+/*
+shoots the stale slots down on every CPU and makes them free
+does nothing if it cannot wait for the other CPUs (see tlb_shootdown)
+*/
+static void vmalloc_flush_stale(void){
+    unsigned i, lo, hi;
+
+    if (curcpu->c_spinlocks > 0 || curthread->t_curspl != IPL_NONE)
+        return;
+
+    spinlock_acquire(&vmalloc_lock);
+    lo = VMALLOC_NPAGES;
+    hi = 0;
+    for (i = 0; i < VMALLOC_NPAGES; i++) {
+        if (vmalloc_map[i] != VMALLOC_STALE)
+            continue;
+        vmalloc_map[i] = VMALLOC_FLUSHING;
+        if (i < lo)
+            lo = i;
+        hi = i;
+    }
+    spinlock_release(&vmalloc_lock);
+
+    if (lo == VMALLOC_NPAGES)
+        return;
+
+    // slots freed meanwhile stay stale: they are not in [lo, hi] as FLUSHING
+    tlb_shootdown(vmalloc_index_to_vaddr(lo), hi - lo + 1);
+
+    spinlock_acquire(&vmalloc_lock);
+    for (i = lo; i <= hi; i++) {
+        if (vmalloc_map[i] == VMALLOC_FLUSHING) {
+            vmalloc_map[i] = 0;
+            vmalloc_nstale--;
+        }
+    }
+    spinlock_release(&vmalloc_lock);
+}
+
+
+/*
+first fit of npages free slots on the kseg2 window (vmalloc_lock held)
+returns the first slot, or VMALLOC_NPAGES if there is no such run
+*/
+static unsigned vmalloc_find(unsigned npages){
+    unsigned i, start, run;
+
+    run = 0;
+    start = 0;
+    for (i = 0; i < VMALLOC_NPAGES && run < npages; i++) {
+        if (vmalloc_map[i] != 0) {
+            run = 0;
+            continue;
+        }
+        if (run == 0)
+            start = i;
+        run++;
+    }
+
+    return run < npages ? VMALLOC_NPAGES : start;
+}
+
+
+/*
+allocates npages virtually contiguous pages, backed by frames anywhere in RAM
+returns NULL if the kseg2 window or physical memory is exhausted
+*/
+void *vmalloc(unsigned npages){
+    unsigned i, start;
+    vaddr_t frame;
+
+    KASSERT(npages > 0);
+
+    if (npages > VMALLOC_NPAGES)
+        return NULL;
+
+    spinlock_acquire(&vmalloc_lock);
+    start = vmalloc_find(npages);
+    if (start == VMALLOC_NPAGES && vmalloc_nstale > 0) {
+        // make the freed slots usable again
+        spinlock_release(&vmalloc_lock);
+        vmalloc_flush_stale();
+        spinlock_acquire(&vmalloc_lock);
+        start = vmalloc_find(npages);
+    }
+
+    if (start == VMALLOC_NPAGES) {
+        spinlock_release(&vmalloc_lock);
+        return NULL;
+    }
+
+    for (i = start; i < start + npages; i++)
+        vmalloc_map[i] = VMALLOC_RESERVED;
+    vmalloc_npages[start] = npages;
+    spinlock_release(&vmalloc_lock);
+
+    for (i = start; i < start + npages; i++) {
+        frame = alloc_kpages(1);
+        if (frame == 0) {
+            vmalloc_release(start, npages);
+            return NULL;
+        }
+
+        spinlock_acquire(&vmalloc_lock);
+        vmalloc_map[i] = frame - MIPS_KSEG0;
+        spinlock_release(&vmalloc_lock);
+    }
+
+    return (void *) vmalloc_index_to_vaddr(start);
+}
+
+
+/*
+frees an allocation returned by vmalloc
+*/
+void vfree(void *ptr){
+    vaddr_t vaddr = (vaddr_t) ptr;
+    unsigned start, npages;
+
+    KASSERT(VMALLOC_ADDR(vaddr));
+    KASSERT(vaddr % PAGE_SIZE == 0);
+
+    start = vmalloc_vaddr_to_index(vaddr);
+
+    spinlock_acquire(&vmalloc_lock);
+    npages = vmalloc_npages[start];
+    spinlock_release(&vmalloc_lock);
+
+    if (npages == 0)
+        panic("vfree: invalid address %p\n", ptr);
+
+    vmalloc_release(start, npages);
+}
+
+
+/*
+returns the number of pages of the allocation starting at ptr
+*/
+unsigned vmalloc_getsize(const void *ptr){
+    unsigned npages;
+
+    KASSERT(VMALLOC_ADDR(ptr));
+
+    spinlock_acquire(&vmalloc_lock);
+    npages = vmalloc_npages[vmalloc_vaddr_to_index((vaddr_t) ptr)];
+    spinlock_release(&vmalloc_lock);
+
+    return npages;
+}
+
+
+/*
+loads the translation of a kseg2 address into the TLB
+returns EFAULT if the address is not part of any allocation
+*/
+int vmalloc_fault(int faulttype, vaddr_t faultaddress){
+    unsigned index;
+    paddr_t paddr;
+    uint32_t entryhi, entrylo;
+    int was_free;
+
+    if (!VMALLOC_ADDR(faultaddress))
+        return EFAULT;
+
+    // mappings are always writable, a read-only fault here is a kernel bug
+    if (faulttype == VM_FAULT_READONLY)
+        return EFAULT;
+
+    index = vmalloc_vaddr_to_index(faultaddress);
+
+    // the spinlock also keeps interrupts off while the TLB is written
+    spinlock_acquire(&vmalloc_lock);
+    paddr = vmalloc_map[index];
+    if (!VMALLOC_HAS_FRAME(paddr)) {
+        spinlock_release(&vmalloc_lock);
+        return EFAULT;
+    }
+
+    entryhi = faultaddress & PAGE_FRAME;
+    entrylo = paddr | TLBLO_VALID | TLBLO_DIRTY;
+    tlb_write(entryhi, entrylo, tlb_get_victim(entryhi, &was_free));
+    spinlock_release(&vmalloc_lock);
+
+    return 0;
+}
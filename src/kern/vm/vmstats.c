@@ -1,12 +1,35 @@
 #include <vmstats.h>
 #include <synch.h>
 #include <lib.h>
+#include <vm.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <mainbus.h>
+#include <platform/maxcpus.h>
 
 static unsigned int stats[VMSTATS_NUM];
 static unsigned int stats_initialized = 0;
 
 static struct lock *stats_lock;
 
+// fault latency histograms, kept per CPU so that vm_fault takes no lock; merged when printed
+struct vmstats_lat {
+    unsigned int count[VMSTATS_LAT_BUCKETS];
+    uint64_t total;
+    unsigned int untimed;       // faults that came back on another CPU: not in the histogram
+};
+
+static struct vmstats_lat lat_stats[MAXCPUS][VMSTATS_LAT_NUM];
+
+static const char *lat_names[] = {
+  "TLB cache",
+  "Reload",
+  "Zero-fill",
+  "ELF",
+  "Swapfile"
+};
+
 static const char *stats_names[] = {
   "TLB Faults", 
   "TLB Faults with Free",
@@ -17,7 +40,21 @@ static const char *stats_names[] = {
   "Page Faults (Disk)",
   "Page Faults from ELF",
   "Page Faults from Swapfile",
-  "Swapfile Writes"
+  "Swapfile Writes",
+  "ZSWAP Stores",
+  "ZSWAP Loads",
+  "ZSWAP Rejects",
+  "ZSWAP Pool Full",
+  "ZSWAP Compressed Bytes",
+  "Zero Pages not Swapped",
+  "Clean Evictions (no Write)",
+  "TLB Cache Hits",
+  "Shrinker Runs",
+  "Shrinker Pages Freed",
+  "ZSWAP Writebacks",
+  "TLB Premature Evictions",
+  "TLB Evicted Age (avg)",
+  "ZSWAP Alloc Failures"
 };
 
 void vmstats_init(void) {
@@ -28,6 +65,7 @@ void vmstats_init(void) {
     for (int i = 0; i < VMSTATS_NUM; i++) {
         stats[i] = 0;
     }
+    bzero(lat_stats, sizeof(lat_stats));
 
     stats_initialized = 1;
 }
@@ -43,6 +81,148 @@ void vmstats_increment(uint8_t stats_type) {
     lock_release(stats_lock);
 }
 
+void vmstats_add(uint8_t stats_type, unsigned int amount) {
+    KASSERT(stats_type < VMSTATS_NUM);
+    KASSERT(stats_initialized);
+
+    lock_acquire(stats_lock);
+
+    stats[stats_type] += amount;
+
+    lock_release(stats_lock);
+}
+
+/*
+takes the starting point of a timed section
+*/
+void vmstats_stamp(struct vmstats_stamp *s) {
+    int spl;
+
+    spl = splhigh();
+    s->cpu = curcpu->c_number;
+    s->hardclocks = curcpu->c_hardclocks;
+    s->cycles = cpu_getcycles();
+    splx(spl);
+}
+
+/*
+sets cycles to the cycles elapsed since start (saturated at 2^32-1) and returns true,
+or returns false if they cannot be known because we are on another CPU
+*/
+int vmstats_elapsed(const struct vmstats_stamp *start, uint32_t *cycles) {
+    uint64_t elapsed;
+    uint32_t now, ticks;
+    int spl, timed;
+
+    spl = splhigh();
+    timed = start->cpu == curcpu->c_number;
+    if (timed) {
+        now = cpu_getcycles();
+        ticks = curcpu->c_hardclocks - start->hardclocks;
+        // the counter went back to zero, but the hardclock interrupt is still pending
+        if (ticks == 0 && now < start->cycles)
+            ticks = 1;
+        // each hardclock in between restarted the counter after a whole tick
+        elapsed = (uint64_t)ticks * mainbus_cycles_per_hardclock() + now - start->cycles;
+        *cycles = elapsed > 0xffffffff ? 0xffffffff : elapsed;
+    }
+    splx(spl);
+
+    return timed;
+}
+
+/*
+adds a fault started at start and resolved through path to the histograms
+faults that came back on another CPU are only counted as untimed
+lock-free: interrupts are only disabled so that the thread stays on this CPU during the update
+*/
+void vmstats_latency(unsigned int path, const struct vmstats_stamp *start) {
+    struct vmstats_lat *l;
+    uint32_t cycles = 0;
+    unsigned int b = 0;
+    int spl, timed;
+
+    KASSERT(path < VMSTATS_LAT_NUM);
+
+    timed = vmstats_elapsed(start, &cycles);
+    while (b < VMSTATS_LAT_BUCKETS - 1 && (cycles >> (b + 1)) != 0)
+        b++;
+
+    spl = splhigh();
+    l = &lat_stats[curcpu->c_number][path];
+    if (timed) {
+        l->count[b]++;
+        l->total += cycles;
+    }
+    else
+        l->untimed++;
+    splx(spl);
+}
+
+/*
+upper bound (in cycles) of the bucket holding the given percentile of n faults
+*/
+static uint32_t lat_percentile(const struct vmstats_lat *l, unsigned int n, unsigned int pct) {
+    unsigned int b, seen = 0;
+    uint32_t target = ((uint64_t)n * pct + 99) / 100;
+
+    for (b = 0; b < VMSTATS_LAT_BUCKETS; b++) {
+        seen += l->count[b];
+        if (seen >= target)
+            break;
+    }
+    return b == VMSTATS_LAT_BUCKETS - 1 ? 0xffffffff : (2U << b) - 1;
+}
+
+static void vmstats_print_latency(void) {
+    struct vmstats_lat sum;
+    unsigned int p, c, b, n, lo, hi, max, width;
+    char bar[41];
+
+    kprintf("\n--- FAULT LATENCY (cycles) ---\n");
+
+    for (p = 0; p < VMSTATS_LAT_NUM; p++) {
+        bzero(&sum, sizeof(sum));
+        for (c = 0; c < MAXCPUS; c++) {
+            for (b = 0; b < VMSTATS_LAT_BUCKETS; b++)
+                sum.count[b] += lat_stats[c][p].count[b];
+            sum.total += lat_stats[c][p].total;
+            sum.untimed += lat_stats[c][p].untimed;
+        }
+
+        n = 0;
+        max = 0;
+        lo = VMSTATS_LAT_BUCKETS;
+        hi = 0;
+        for (b = 0; b < VMSTATS_LAT_BUCKETS; b++) {
+            if (sum.count[b] == 0)
+                continue;
+            n += sum.count[b];
+            if (sum.count[b] > max)
+                max = sum.count[b];
+            if (lo == VMSTATS_LAT_BUCKETS)
+                lo = b;
+            hi = b;
+        }
+        if (n == 0) {
+            if (sum.untimed > 0)
+                kprintf("\n%s: %u untimed faults\n", lat_names[p], sum.untimed);
+            continue;
+        }
+
+        kprintf("\n%s: %d faults, average %llu, p50 <= %u, p99 <= %u, %u untimed\n", lat_names[p], n,
+                sum.total / n, lat_percentile(&sum, n, 50), lat_percentile(&sum, n, 99), sum.untimed);
+
+        for (b = lo; b <= hi; b++) {
+            width = (unsigned int)(((uint64_t)sum.count[b] * 40) / max);
+            memset(bar, '#', width);
+            bar[width] = '\0';
+            kprintf("\t%10u - %-10u | %-40s %d\n", b == 0 ? 0 : 1U << b,
+                    b == VMSTATS_LAT_BUCKETS - 1 ? 0xffffffff : (2U << b) - 1, bar, sum.count[b]);
+        }
+    }
+}
+
 void vmstats_print(void) {
     KASSERT(stats_initialized);
     
@@ -89,9 +269,45 @@ void vmstats_print(void) {
     else
         kprintf("INFO: ELF File reads + Swapfile reads = %d\n\t--> Correct!\n", page_fault_disk_elf_swapfile);
 
+    // Share of TLB replacements that threw out an entry needed again right after
+    if (stats[VMSTATS_TLB_FAULTS_WITH_REPLACE] > 0) {
+        kprintf("\n--- TLB REPLACEMENT ---\n\n");
+
+        unsigned long long premature = ((unsigned long long)stats[VMSTATS_TLB_PREMATURE_EVICTIONS] * 10000) / stats[VMSTATS_TLB_FAULTS_WITH_REPLACE];
+        kprintf("INFO: Premature evictions = %llu.%02llu%% of replacements, evicted entries were %d refills old on average\n",
+                premature / 100, premature % 100, stats[VMSTATS_TLB_EVICTED_AGE]);
+    }
+
+    // Compressed swap pool, ratio and hit rate are printed with two decimals
+    if (stats[VMSTATS_ZSWAP_STORES] > 0) {
+        kprintf("\n--- COMPRESSED SWAP ---\n\n");
+
+        unsigned long long uncompressed = (unsigned long long)stats[VMSTATS_ZSWAP_STORES] * PAGE_SIZE;
+        unsigned long long ratio = (uncompressed * 100) / stats[VMSTATS_ZSWAP_COMPRESSED_BYTES];
+        kprintf("INFO: Compression ratio = %llu.%02llu\n", ratio / 100, ratio % 100);
+
+        if (stats[VMSTATS_PAGE_FAULTS_SWAPFILE] > 0) {
+            unsigned long long hits = ((unsigned long long)stats[VMSTATS_ZSWAP_LOADS] * 10000) / stats[VMSTATS_PAGE_FAULTS_SWAPFILE];
+            kprintf("INFO: Pool hit rate = %llu.%02llu%% (%d of %d swap-ins)\n", hits / 100, hits % 100,
+                    stats[VMSTATS_ZSWAP_LOADS], stats[VMSTATS_PAGE_FAULTS_SWAPFILE]);
+        }
+    }
+
+    vmstats_print_latency();
+
     lock_release(stats_lock);
 }
 
+/*
+prints the contention counters of stats_lock, with the other lock statistics
+*/
+void vmstats_printlocks(void) {
+    if (!stats_initialized)
+        return;
+
+    lock_printstats(stats_lock);
+}
+
 void vmstats_destroy(void) {
     KASSERT(stats_initialized);
 
@@ -0,0 +1,208 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <proc.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <platform/maxcpus.h>
+#include <vmtrace.h>
+#include "opt-waitpid.h"
+
+/*
+Each CPU writes only its own ring, with interrupts off, so recording takes no lock.
+Readers (stats and dump) look at the rings of the other CPUs while they may still be
+written: a record caught in the middle of an update can come out mixed.
+*/
+
+struct vmtrace_ring {
+    unsigned int count;         // records ever written, next slot is count % VMTRACE_RECORDS
+    struct vmtrace_record rec[VMTRACE_RECORDS];
+};
+
+//allocated on the first fault of each CPU
+static struct vmtrace_ring *vmtrace_rings[MAXCPUS];
+
+
+/*
+records a fault handled by vm_fault(), start is taken at its entry
+*/
+void vmtrace_record(int faulttype, vaddr_t vaddr, int path, vaddr_t victim, const struct vmstats_stamp *start){
+    struct vmtrace_ring *ring;
+    struct vmtrace_record *r;
+    uint32_t latency = 0;
+    unsigned int cpu;
+    int spl, timed;
+
+    timed = vmstats_elapsed(start, &latency);
+
+    cpu = curcpu->c_number;
+    if (vmtrace_rings[cpu] == NULL) {
+        // may sleep, so it is done before disabling interrupts
+        ring = kmalloc(sizeof(struct vmtrace_ring));
+        if (ring == NULL)
+            return;
+        bzero(ring, sizeof(struct vmtrace_ring));
+
+        spl = splhigh();
+        if (vmtrace_rings[cpu] == NULL) {
+            vmtrace_rings[cpu] = ring;
+            ring = NULL;
+        }
+        splx(spl);
+
+        if (ring != NULL)
+            kfree(ring);
+    }
+
+    spl = splhigh();
+
+    // we may have been moved to another CPU while sleeping
+    cpu = curcpu->c_number;
+    ring = vmtrace_rings[cpu];
+    if (ring != NULL) {
+        r = &ring->rec[ring->count % VMTRACE_RECORDS];
+        r->hardclocks = start->hardclocks;
+        r->cycles = start->cycles;
+        r->latency = latency;
+        r->vaddr = vaddr;
+        r->victim = victim;
+#if OPT_WAITPID
+        r->pid = curproc != NULL ? curproc->p_pid : -1;
+#else
+        r->pid = -1;
+#endif
+        r->faulttype = faulttype;
+        r->path = path;
+        r->cpu = start->cpu;
+        r->flags = timed ? 0 : VMTRACE_UNTIMED;
+        ring->count++;
+    }
+
+    splx(spl);
+}
+
+
+/*
+prints how many records each CPU holds
+*/
+void vmtrace_printstats(void){
+    unsigned int i, count;
+
+    kprintf("VM trace (%u records per cpu):\n", VMTRACE_RECORDS);
+    for (i = 0; i < MAXCPUS; i++) {
+        if (vmtrace_rings[i] == NULL)
+            continue;
+        count = vmtrace_rings[i]->count;
+        kprintf("    cpu%u: %u faults recorded, %u kept\n", i, count,
+                count < VMTRACE_RECORDS ? count : VMTRACE_RECORDS);
+    }
+}
+
+
+/*
+drops every record (rings stay allocated)
+*/
+void vmtrace_clear(void){
+    unsigned int i;
+
+    for (i = 0; i < MAXCPUS; i++) {
+        if (vmtrace_rings[i] != NULL)
+            vmtrace_rings[i]->count = 0;
+    }
+}
+
+
+static int vmtrace_write(struct vnode *v, off_t *offset, void *buf, size_t len){
+    struct iovec iov;
+    struct uio u;
+    int res;
+
+    uio_kinit(&iov, &u, buf, len, *offset, UIO_WRITE);
+    res = VOP_WRITE(v, &u);
+    if (res)
+        return res;
+    if (u.uio_resid != 0)
+        return EIO;
+
+    *offset += len;
+    return 0;
+}
+
+
+/*
+writes the rings to a file, oldest record first
+layout: header {magic, version, record size, number of cpus}, then for each cpu
+{cpu number, number of records} followed by the records
+*/
+int vmtrace_dump(const char *path){
+    struct vmtrace_ring *copy;
+    struct vnode *v;
+    char *pathcopy;
+    uint32_t header[4], cpuheader[2];
+    unsigned int i, n, first, tail, ncpus = 0;
+    off_t offset = 0;
+    int res, spl;
+
+    for (i = 0; i < MAXCPUS; i++) {
+        if (vmtrace_rings[i] != NULL)
+            ncpus++;
+    }
+
+    // a private copy per cpu, so that the records do not change while being written
+    copy = kmalloc(sizeof(struct vmtrace_ring));
+    if (copy == NULL)
+        return ENOMEM;
+
+    // vfs_open may modify the path
+    pathcopy = kstrdup(path);
+    if (pathcopy == NULL) {
+        kfree(copy);
+        return ENOMEM;
+    }
+    res = vfs_open(pathcopy, O_WRONLY | O_CREAT | O_TRUNC, 0664, &v);
+    kfree(pathcopy);
+    if (res) {
+        kfree(copy);
+        return res;
+    }
+
+    header[0] = VMTRACE_MAGIC;
+    header[1] = VMTRACE_VERSION;
+    header[2] = sizeof(struct vmtrace_record);
+    header[3] = ncpus;
+    res = vmtrace_write(v, &offset, header, sizeof(header));
+
+    for (i = 0; i < MAXCPUS && res == 0; i++) {
+        if (vmtrace_rings[i] == NULL)
+            continue;
+
+        spl = splhigh();
+        memcpy(copy, vmtrace_rings[i], sizeof(struct vmtrace_ring));
+        splx(spl);
+
+        n = copy->count < VMTRACE_RECORDS ? copy->count : VMTRACE_RECORDS;
+        first = (copy->count - n) % VMTRACE_RECORDS;
+
+        cpuheader[0] = i;
+        cpuheader[1] = n;
+        res = vmtrace_write(v, &offset, cpuheader, sizeof(cpuheader));
+
+        // the ring wraps: oldest records up to the end of the array, then from the start
+        tail = n < VMTRACE_RECORDS - first ? n : VMTRACE_RECORDS - first;
+        if (res == 0 && tail > 0)
+            res = vmtrace_write(v, &offset, &copy->rec[first], tail * sizeof(struct vmtrace_record));
+        if (res == 0 && n > tail)
+            res = vmtrace_write(v, &offset, &copy->rec[0], (n - tail) * sizeof(struct vmtrace_record));
+    }
+
+    vfs_close(v);
+    kfree(copy);
+
+    return res;
+}
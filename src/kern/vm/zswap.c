@@ -0,0 +1,453 @@
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <vm.h>
+#include <zswap.h>
+#include <swapfile.h>
+#include <shrinker.h>
+#include <vmstats.h>
+
+/*
+Compressed swap cache: evicted pages are compressed into kmalloc'd buffers
+and kept in RAM until the pool is full, then they go to the swapfile.
+
+Codec is a small LZ77 variant. The output is a sequence of groups, each one
+is a flag byte followed by up to 8 items: bit i clear means item i is a literal
+byte, bit i set means it is a match encoded as
+    [offset hi (4 bits) | length - LZ_MIN_MATCH (4 bits)] [offset lo (8 bits)]
+with an extra length byte when the 4-bit length field is saturated.
+*/
+
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_OFFSET 4095
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15 + 255)
+#define LZ_MAX_GROUP_SIZE (1 + 8 * 3)
+
+#define ZSWAP_HASH_BITS 10
+#define ZSWAP_HASH_SIZE (1 << ZSWAP_HASH_BITS)
+
+struct zswap_entry {
+    void *data;                     // compressed page, NULL if slot not in pool
+    uint16_t len;                   // compressed length
+};
+
+//one entry per swapfile slot
+static struct zswap_entry *zswap_entries;
+static unsigned int zswap_nslots = 0;
+
+//bytes currently held by compressed pages, and upper bound
+static size_t zswap_pool_bytes = 0;
+static size_t zswap_pool_limit = 0;
+
+//protects entries, pool accounting and the scratch buffers below
+static struct lock *zswap_lock;
+
+//scratch space for the compressor and for writeback (used under zswap_lock only)
+static uint8_t zswap_buffer[ZSWAP_MAX_COMPRESSED_SIZE];
+static uint16_t zswap_hashtable[ZSWAP_HASH_SIZE];
+static uint8_t zswap_page[PAGE_SIZE];
+
+//next slot to be considered for writeback
+static unsigned int zswap_wb_cursor = 0;
+
+/*
+writeback runs in its own thread: the shrinker is called from inside the
+page allocator, where the caller may hold any sleep lock (even the ones of
+the swapfile's filesystem), so it must not do I/O. It only asks for pages
+here, under zswap_wb_lock, and the thread writes them out
+*/
+static struct spinlock zswap_wb_lock = SPINLOCK_INITIALIZER_NAMED("zswap_wb_lock");
+static struct wchan *zswap_wb_wchan;
+static unsigned int zswap_wb_pages = 0;     //pages worth of pool to write back
+static bool zswap_wb_exit = false;
+static struct semaphore *zswap_wb_done;     //signalled when the thread exits
+
+static unsigned int zswap_shrink(unsigned int npages);
+static void zswap_writeback_thread(void *data1, unsigned long data2);
+
+static struct shrinker zswap_shrinker = {
+    .name = "zswap",
+    .shrink = zswap_shrink,
+    .next = NULL,
+};
+
+
+static uint32_t lz_hash(const uint8_t *p){
+    uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return (v * 2654435761U) >> (32 - ZSWAP_HASH_BITS);
+}
+
+
+/*
+compresses srclen bytes from src into dst
+returns the compressed length, or 0 if it would not fit in dstmax bytes
+*/
+static size_t lz_compress(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstmax){
+    size_t ip = 0, op = 0;
+    size_t flagpos, len, off, cand;
+    uint32_t h;
+    uint8_t flags;
+    int i;
+
+    //hash table stores position + 1, 0 means empty
+    bzero(zswap_hashtable, sizeof(zswap_hashtable));
+
+    while (ip < srclen) {
+        if (op + LZ_MAX_GROUP_SIZE > dstmax)
+            return 0;
+
+        flagpos = op++;
+        flags = 0;
+
+        for (i = 0; i < 8 && ip < srclen; i++) {
+            len = 0;
+            off = 0;
+
+            if (ip + LZ_MIN_MATCH <= srclen) {
+                h = lz_hash(src + ip);
+                cand = zswap_hashtable[h];
+                zswap_hashtable[h] = ip + 1;
+
+                if (cand != 0) {
+                    cand--;
+                    off = ip - cand;
+                    if (off <= LZ_MAX_OFFSET) {
+                        //matches may overlap the current position (runs)
+                        while (len < LZ_MAX_MATCH && ip + len < srclen && src[cand + len] == src[ip + len])
+                            len++;
+                    }
+                }
+            }
+
+            if (len >= LZ_MIN_MATCH) {
+                flags |= 1 << i;
+                len -= LZ_MIN_MATCH;
+                dst[op++] = ((off >> 8) << 4) | (len < 15 ? len : 15);
+                dst[op++] = off & 0xff;
+                if (len >= 15)
+                    dst[op++] = len - 15;
+                ip += len + LZ_MIN_MATCH;
+            }
+            else {
+                dst[op++] = src[ip++];
+            }
+        }
+
+        dst[flagpos] = flags;
+    }
+
+    return op;
+}
+
+
+/*
+decompresses srclen bytes from src into dst, which must be filled exactly
+returns 0 on success, -1 on corrupted input
+*/
+static int lz_decompress(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen){
+    size_t ip = 0, op = 0;
+    size_t len, off;
+    uint8_t flags;
+    int i;
+
+    while (ip < srclen) {
+        flags = src[ip++];
+
+        for (i = 0; i < 8 && ip < srclen; i++) {
+            if (flags & (1 << i)) {
+                if (ip + 2 > srclen)
+                    return -1;
+                off = ((size_t)(src[ip] >> 4) << 8) | src[ip + 1];
+                len = src[ip] & 0xf;
+                ip += 2;
+                if (len == 15) {
+                    if (ip >= srclen)
+                        return -1;
+                    len += src[ip++];
+                }
+                len += LZ_MIN_MATCH;
+
+                if (off == 0 || off > op || op + len > dstlen)
+                    return -1;
+
+                //byte by byte, source and destination may overlap
+                while (len-- > 0) {
+                    dst[op] = dst[op - off];
+                    op++;
+                }
+            }
+            else {
+                if (op >= dstlen)
+                    return -1;
+                dst[op++] = src[ip++];
+            }
+        }
+    }
+
+    return op == dstlen ? 0 : -1;
+}
+
+
+/*
+initializes the compressed pool, one (empty) entry for each swapfile slot
+*/
+int zswap_init(unsigned int nslots){
+    unsigned int i;
+
+    zswap_lock = lock_create("zswap_lock");
+    if (zswap_lock == NULL)
+        panic("Failed to create zswap lock\n");
+
+    zswap_entries = kmalloc(nslots * sizeof(struct zswap_entry));
+    if (zswap_entries == NULL)
+        panic("Failed to allocate zswap entries\n");
+
+    for (i = 0; i < nslots; i++) {
+        zswap_entries[i].data = NULL;
+        zswap_entries[i].len = 0;
+    }
+
+    zswap_nslots = nslots;
+    zswap_pool_bytes = 0;
+    zswap_pool_limit = (ram_getsize() / 100) * ZSWAP_POOL_PERCENT;
+    zswap_wb_cursor = 0;
+
+    zswap_wb_wchan = wchan_create("zswap_wb");
+    zswap_wb_done = sem_create("zswap_wb_done", 0);
+    if (zswap_wb_wchan == NULL || zswap_wb_done == NULL)
+        panic("Failed to create zswap writeback wait channel\n");
+    zswap_wb_pages = 0;
+    zswap_wb_exit = false;
+    if (thread_fork("zswap_wb", NULL, zswap_writeback_thread, NULL, 0))
+        panic("Failed to start zswap writeback thread\n");
+
+    shrinker_register(&zswap_shrinker);
+
+    return 0;
+}
+
+
+/*
+releases every compressed page still in the pool
+*/
+void zswap_close(void){
+    unsigned int i;
+
+    KASSERT(zswap_entries != NULL);
+
+    shrinker_unregister(&zswap_shrinker);
+
+    spinlock_acquire(&zswap_wb_lock);
+    zswap_wb_exit = true;
+    wchan_wakeall(zswap_wb_wchan, &zswap_wb_lock);
+    spinlock_release(&zswap_wb_lock);
+    P(zswap_wb_done);
+    sem_destroy(zswap_wb_done);
+    wchan_destroy(zswap_wb_wchan);
+
+    for (i = 0; i < zswap_nslots; i++) {
+        if (zswap_entries[i].data != NULL)
+            kfree(zswap_entries[i].data);
+    }
+
+    kfree(zswap_entries);
+    zswap_entries = NULL;
+    zswap_nslots = 0;
+    zswap_pool_bytes = 0;
+
+    lock_destroy(zswap_lock);
+}
+
+
+/*
+tries to keep the page at paddr in the compressed pool, under swap slot index
+returns 0 if stored, ENOSPC if the page has to be written to the swapfile
+(not compressible enough or pool full)
+*/
+int zswap_store(unsigned int index, paddr_t paddr){
+    size_t len;
+    void *data;
+
+    KASSERT(index < zswap_nslots);
+    KASSERT(paddr != 0);
+
+    lock_acquire(zswap_lock);
+
+    KASSERT(zswap_entries[index].data == NULL);
+
+    len = lz_compress((const uint8_t *) PADDR_TO_KVADDR(paddr), PAGE_SIZE, zswap_buffer, sizeof(zswap_buffer));
+    if (len == 0) {
+        lock_release(zswap_lock);
+        vmstats_increment(VMSTATS_ZSWAP_REJECTS);
+        return ENOSPC;
+    }
+
+    if (zswap_pool_bytes + len > zswap_pool_limit) {
+        lock_release(zswap_lock);
+        vmstats_increment(VMSTATS_ZSWAP_POOL_FULL);
+        return ENOSPC;
+    }
+
+    data = kmalloc(len);
+    if (data == NULL) {
+        //the pool has room, the kernel heap does not
+        lock_release(zswap_lock);
+        vmstats_increment(VMSTATS_ZSWAP_ALLOC_FAILS);
+        return ENOSPC;
+    }
+
+    memcpy(data, zswap_buffer, len);
+    zswap_entries[index].data = data;
+    zswap_entries[index].len = len;
+    zswap_pool_bytes += len;
+
+    lock_release(zswap_lock);
+
+    vmstats_increment(VMSTATS_ZSWAP_STORES);
+    vmstats_add(VMSTATS_ZSWAP_COMPRESSED_BYTES, len);
+
+    return 0;
+}
+
+
+/*
+if swap slot index lives in the pool, decompresses it into paddr and drops it
+returns 0 on hit, ENOENT if the page has to be read from the swapfile
+*/
+int zswap_load(unsigned int index, paddr_t paddr){
+    struct zswap_entry entry;
+
+    KASSERT(index < zswap_nslots);
+    KASSERT(paddr != 0);
+
+    lock_acquire(zswap_lock);
+    entry = zswap_entries[index];
+    if (entry.data == NULL) {
+        lock_release(zswap_lock);
+        return ENOENT;
+    }
+    zswap_entries[index].data = NULL;
+    zswap_entries[index].len = 0;
+    zswap_pool_bytes -= entry.len;
+    lock_release(zswap_lock);
+
+    if (lz_decompress(entry.data, entry.len, (uint8_t *) PADDR_TO_KVADDR(paddr), PAGE_SIZE))
+        panic("Corrupted compressed page in zswap pool\n");
+
+    kfree(entry.data);
+
+    vmstats_increment(VMSTATS_ZSWAP_LOADS);
+
+    return 0;
+}
+
+
+/*
+drops swap slot index from the pool (if present) without reading it back
+*/
+void zswap_invalidate(unsigned int index){
+    void *data;
+
+    KASSERT(index < zswap_nslots);
+
+    lock_acquire(zswap_lock);
+    data = zswap_entries[index].data;
+    if (data != NULL) {
+        zswap_pool_bytes -= zswap_entries[index].len;
+        zswap_entries[index].data = NULL;
+        zswap_entries[index].len = 0;
+    }
+    lock_release(zswap_lock);
+
+    if (data != NULL)
+        kfree(data);
+}
+
+
+/*
+moves compressed pages to their (already reserved) swapfile slot and frees
+their buffers, until about npages pages worth of pool memory has been released
+slots are visited round robin, so that the same pages are not always the first to go
+called by the writeback thread only, with zswap_lock held
+*/
+static void zswap_writeback(unsigned int npages){
+    size_t target = (size_t) npages * PAGE_SIZE, freed = 0;
+    unsigned int i, n;
+    void *data;
+
+    KASSERT(lock_do_i_hold(zswap_lock));
+
+    for (n = 0; n < zswap_nslots && freed < target; n++) {
+        i = zswap_wb_cursor;
+        zswap_wb_cursor = (zswap_wb_cursor + 1) % zswap_nslots;
+
+        data = zswap_entries[i].data;
+        if (data == NULL)
+            continue;
+
+        // the lock stays held, so a concurrent zswap_load() finds the page in the swapfile
+        if (lz_decompress(data, zswap_entries[i].len, zswap_page, PAGE_SIZE))
+            panic("Corrupted compressed page in zswap pool\n");
+        swap_write_slot(i, zswap_page);
+
+        freed += zswap_entries[i].len;
+        zswap_pool_bytes -= zswap_entries[i].len;
+        zswap_entries[i].data = NULL;
+        zswap_entries[i].len = 0;
+        kfree(data);
+
+        vmstats_increment(VMSTATS_ZSWAP_WRITEBACKS);
+    }
+}
+
+
+/*
+writeback thread: sleeps until the shrinker asks for pages, then writes them out
+*/
+static void zswap_writeback_thread(void *data1, unsigned long data2){
+    unsigned int npages;
+
+    (void)data1;
+    (void)data2;
+
+    spinlock_acquire(&zswap_wb_lock);
+    while (!zswap_wb_exit) {
+        if (zswap_wb_pages == 0) {
+            wchan_sleep(zswap_wb_wchan, &zswap_wb_lock);
+            continue;
+        }
+        npages = zswap_wb_pages;
+        zswap_wb_pages = 0;
+        spinlock_release(&zswap_wb_lock);
+
+        lock_acquire(zswap_lock);
+        zswap_writeback(npages);
+        lock_release(zswap_lock);
+
+        spinlock_acquire(&zswap_wb_lock);
+    }
+    spinlock_release(&zswap_wb_lock);
+
+    V(zswap_wb_done);
+}
+
+
+/*
+shrinker: called from the page allocator, so it neither sleeps nor does I/O;
+it hands the request to the writeback thread
+the buffers that thread frees are mostly smaller than a page and kfree does not
+always give pages back, so nothing is released here for sure: returns 0
+*/
+static unsigned int zswap_shrink(unsigned int npages){
+    spinlock_acquire(&zswap_wb_lock);
+    if (!zswap_wb_exit) {
+        zswap_wb_pages += npages;
+        wchan_wakeone(zswap_wb_wchan, &zswap_wb_lock);
+    }
+    spinlock_release(&zswap_wb_lock);
+
+    return 0;
+}
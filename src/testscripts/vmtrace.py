@@ -0,0 +1,176 @@
+#!/usr/pkg/bin/python2.7
+# vmtrace.py - decode a VM fault trace dumped by the kernel
+# usage: vmtrace.py [options] tracefile
+# options:
+#    --records		Print every record, oldest first
+#    --bucket=N		Width in hardclock ticks of the timeline buckets (default 10)
+#
+# The trace file is written from the kernel menu with "vmtrace dump [file]"
+# (by default emu0:/VMTRACE, that is, VMTRACE in the directory sys161 runs
+# in). It holds the per-cpu rings of struct vmtrace_record, see
+# kern/include/vmtrace.h for the layout. Values are big-endian.
+#
+# The cycle counter restarts at every hardclock, so a fault is placed in
+# time by the hardclock count of its cpu, and its latency is only known
+# when it ended on the same cpu. Faults that moved are flagged untimed
+# and left out of the latency figures. Hardclock counts of different
+# cpus are not in sync, so the timeline is printed per cpu.
+#
+
+import sys
+import struct
+import getopt
+
+MAGIC = 0x564d5452
+VERSION = 2
+RECORD = ">IIIIIiBBBB"
+RECORDSIZE = struct.calcsize(RECORD)
+
+FAULTTYPES = { 0: "read", 1: "write", 2: "readonly" }
+PATHS = [ "cache", "reload", "zero", "elf", "swap", "dirty" ]
+UNTIMED = 0x01
+
+# record fields
+R_TICKS, R_CYCLES, R_LATENCY, R_VADDR, R_VICTIM, R_PID, R_TYPE, R_PATH, \
+	R_CPU, R_FLAGS = range(10)
+
+def usage():
+	sys.stderr.write("Usage: %s [--records] [--bucket=N] tracefile\n"
+			 % sys.argv[0])
+	sys.exit(1)
+
+def load(filename):
+	f = open(filename, "rb")
+	data = f.read()
+	f.close()
+
+	magic, version, recsize, ncpus = struct.unpack_from(">IIII", data, 0)
+	if magic != MAGIC or version != VERSION:
+		sys.stderr.write("%s: not a VM trace file\n" % filename)
+		sys.exit(1)
+	if recsize != RECORDSIZE:
+		sys.stderr.write("%s: unexpected record size %d\n"
+				 % (filename, recsize))
+		sys.exit(1)
+
+	cpus = {}
+	offset = 16
+	for i in range(ncpus):
+		cpu, n = struct.unpack_from(">II", data, offset)
+		offset += 8
+		recs = []
+		for j in range(n):
+			recs.append(struct.unpack_from(RECORD, data, offset))
+			offset += RECORDSIZE
+		cpus[cpu] = recs
+	return cpus
+
+def percentile(sortedvals, p):
+	if len(sortedvals) == 0:
+		return 0
+	k = (len(sortedvals) - 1) * p // 100
+	return sortedvals[k]
+
+def pathname(path):
+	if path < len(PATHS):
+		return PATHS[path]
+	return "path%d" % path
+
+def printrecords(cpu, recs):
+	print("cpu%d:" % cpu)
+	print("  %4s %10s %10s %10s %6s %-8s %-6s %10s %10s" %
+	      ("cpu", "ticks", "cycles", "latency", "pid", "type", "path",
+	       "vaddr", "victim"))
+	for (ticks, cycles, latency, vaddr, victim, pid, ftype, path, c,
+	     flags) in recs:
+		if victim != 0:
+			vstr = "0x%08x" % victim
+		else:
+			vstr = "-"
+		if flags & UNTIMED:
+			lstr = "untimed"
+		else:
+			lstr = "%u" % latency
+		print("  %4d %10u %10u %10s %6d %-8s %-6s 0x%08x %10s" %
+		      (c, ticks, cycles, lstr, pid,
+		       FAULTTYPES.get(ftype, str(ftype)),
+		       pathname(path), vaddr, vstr))
+
+def printlatency(allrecs):
+	print("Latency (cycles) by resolution path:")
+	print("  %-6s %7s %8s %10s %10s %10s %10s" %
+	      ("path", "faults", "untimed", "p50", "p90", "p99", "max"))
+	for path in range(len(PATHS)):
+		recs = [r for r in allrecs if r[R_PATH] == path]
+		if len(recs) == 0:
+			continue
+		lat = sorted([r[R_LATENCY] for r in recs
+			      if not r[R_FLAGS] & UNTIMED])
+		untimed = len(recs) - len(lat)
+		if len(lat) == 0:
+			print("  %-6s %7d %8d" % (pathname(path), len(recs),
+						  untimed))
+			continue
+		print("  %-6s %7d %8d %10d %10d %10d %10d" %
+		      (pathname(path), len(recs), untimed,
+		       percentile(lat, 50), percentile(lat, 90),
+		       percentile(lat, 99), lat[-1]))
+	evictions = len([r for r in allrecs if r[R_VICTIM] != 0])
+	print("  %d faults, %d needed an eviction" % (len(allrecs), evictions))
+
+def printtimeline(cpu, recs, bucket):
+	if len(recs) == 0:
+		return
+	print("cpu%d timeline (%d hardclock ticks per bucket):" % (cpu, bucket))
+	# measure from the earliest fault
+	base = min([r[R_TICKS] for r in recs])
+	buckets = {}
+	for r in recs:
+		b = (r[R_TICKS] - base) // bucket
+		counts = buckets.setdefault(b, [0] * len(PATHS))
+		if r[R_PATH] < len(PATHS):
+			counts[r[R_PATH]] += 1
+	print("  %8s %6s  %s" % ("bucket", "faults",
+				   " ".join(["%6s" % p for p in PATHS])))
+	for b in sorted(buckets.keys()):
+		counts = buckets[b]
+		print("  %8d %6d  %s" % (b, sum(counts),
+					   " ".join(["%6d" % n for n in counts])))
+
+def main():
+	try:
+		opts, args = getopt.getopt(sys.argv[1:], "", ["records", "bucket="])
+	except getopt.GetoptError:
+		usage()
+
+	records = False
+	bucket = 10
+	for (opt, val) in opts:
+		if opt == "--records":
+			records = True
+		elif opt == "--bucket":
+			bucket = int(val)
+	if len(args) != 1 or bucket <= 0:
+		usage()
+
+	cpus = load(args[0])
+	allrecs = []
+	for cpu in sorted(cpus.keys()):
+		allrecs += cpus[cpu]
+
+	# a fault that moved is kept by the cpu it ended on, but its
+	# timestamp belongs to the cpu it was taken on
+	started = {}
+	for r in allrecs:
+		started.setdefault(r[R_CPU], []).append(r)
+
+	if records:
+		for cpu in sorted(cpus.keys()):
+			printrecords(cpu, cpus[cpu])
+		print("")
+	printlatency(allrecs)
+	for cpu in sorted(started.keys()):
+		print("")
+		printtimeline(cpu, started[cpu], bucket)
+
+main()
@@ -340,6 +340,47 @@ cmd_exit(int ac, char *av[], struct exitinfo *ei)
 	exit(code);
 }
 
+#ifndef HOST
+/*
+ * rusage
+ * prints the VM usage of the shell itself (or, with -c, of its children,
+ * which the kernel reports as all zeroes as long as there is no fork).
+ */
+static
+void
+cmd_rusage(int ac, char *av[], struct exitinfo *ei)
+{
+	struct rusage ru;
+	int who = RUSAGE_SELF;
+
+	if (ac == 2 && !strcmp(av[1], "-c")) {
+		who = RUSAGE_CHILDREN;
+	}
+	else if (ac != 1) {
+		printf("Usage: rusage [-c]\n");
+		exitinfo_exit(ei, 1);
+		return;
+	}
+
+	if (getrusage(who, &ru)) {
+		warn("getrusage");
+		exitinfo_exit(ei, 1);
+		return;
+	}
+
+	printf("TLB faults:        %llu\n", ru.ru_tlbfaults);
+	printf("Minor faults:      %llu\n", ru.ru_minflt);
+	printf("Major faults:      %llu\n", ru.ru_majflt);
+	printf("Page faults:\n");
+	printf("  zero-filled:     %llu\n", ru.ru_zerofill);
+	printf("  from executable: %llu\n", ru.ru_elfload);
+	printf("  from swap:       %llu\n", ru.ru_swapin);
+	printf("Swap-outs:         %llu\n", ru.ru_swapout);
+	printf("Resident:          %u KB\n", (unsigned)ru.ru_rss);
+	exitinfo_exit(ei, 0);
+}
+#endif
+
 /*
  * a struct of the builtins associates the builtin name with the function that
  * executes it.  they must all take an argc and argv.
@@ -352,6 +393,9 @@ static struct {
 	{ "chdir", cmd_chdir },
 	{ "exit",  cmd_exit },
 	{ "wait",  cmd_wait },
+#ifndef HOST
+	{ "rusage", cmd_rusage },
+#endif
 	{ NULL, NULL }
 };
 
@@ -326,7 +326,7 @@ status_is_failure(int status)
 
 static
 void
-makeprocs(bool dowait)
+makeprocs(bool dowait, int pincpus)
 {
 	int i, status, failcount;
 	struct usem s1, s2;
@@ -353,6 +353,10 @@ makeprocs(bool dowait)
 		}
 		if (pids[i]==0) {
 			/* child */
+			if (pincpus > 0 &&
+			    setaffinity(0, 1U << (i % pincpus)) < 0) {
+				warn("setaffinity (process %d)", i);
+			}
 			if (dowait) {
 				say("Process %d forked\n", i);
 				semopen(&s1);
@@ -406,20 +410,24 @@ int
 main(int argc, char *argv[])
 {
 	bool dowait = false;
+	int pincpus = 0;
+	int i;
 
-	if (argc == 0) {
-		/* broken/unimplemented argv handling; do nothing */
-	}
-	else if (argc == 1) {
-		/* nothing */
-	}
-	else if (argc == 2 && !strcmp(argv[1], "-w")) {
-		dowait = true;
-	}
-	else {
-		printf("Usage: parallelvm [-w]\n");
-		return 1;
+	/* argc == 0 is broken/unimplemented argv handling; do nothing */
+	for (i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "-w")) {
+			dowait = true;
+		}
+		else if (!strcmp(argv[i], "-p") && i+1 < argc &&
+			 atoi(argv[i+1]) > 0 && atoi(argv[i+1]) <= 32) {
+			/* pin job N to cpu N mod the given number of cpus */
+			pincpus = atoi(argv[++i]);
+		}
+		else {
+			printf("Usage: parallelvm [-w] [-p ncpus]\n");
+			return 1;
+		}
 	}
-	makeprocs(dowait);
+	makeprocs(dowait, pincpus);
 	return 0;
 }